@@ -22,35 +22,327 @@
  *
  */
 
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
 #include <errno.h>
+#include <limits.h>
 #include <endian.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <linux/netlink.h>
+
+#include <pthread.h>
 
 #include <libusb.h>
 
+#include "pcan-shm.h"
+
+/*
+ * USDT tracepoints, e.g. "bpftrace -l 'usdt:./pcan-id:pcan_id:*'". Without
+ * an attached tracer a probe is a single nop.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define PCAN_PROBE0(name) DTRACE_PROBE(pcan_id, name)
+#define PCAN_PROBE1(name, a) DTRACE_PROBE1(pcan_id, name, a)
+#define PCAN_PROBE2(name, a, b) DTRACE_PROBE2(pcan_id, name, a, b)
+#define PCAN_PROBE4(name, a, b, c, d) DTRACE_PROBE4(pcan_id, name, a, b, c, d)
+#define PCAN_PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(pcan_id, name, a, b, c, d, e)
+#else
+#define PCAN_PROBE0(name) do { } while (0)
+#define PCAN_PROBE1(name, a) do { } while (0)
+#define PCAN_PROBE2(name, a, b) do { } while (0)
+#define PCAN_PROBE4(name, a, b, c, d) do { } while (0)
+#define PCAN_PROBE5(name, a, b, c, d, e) do { } while (0)
+#endif
+
 
 #define USB_TIMEOUT_MS 2000
 
+/* granularity at which a pending transfer notices a cancellation */
+#define PCAN_CANCEL_POLL_MS 100
+
+/*
+ * Transfers and their buffers are allocated once per opened device, large
+ * enough for a control setup packet plus the longest command message.
+ */
+#define PCAN_POOL_SIZE 4
+#define PCAN_XFER_BUF_LEN (LIBUSB_CONTROL_SETUP_SIZE + 64)
+
+/* fleet scheduling defaults, see pcan_fleet_run() */
+#define PCAN_FLEET_JOBS 8
+#define PCAN_FLEET_HUB_RESETS 1
+
+/* per-thread statistics slots and transfer latency histogram buckets */
+#define PCAN_STATS_SLOTS 64
+#define PCAN_LATENCY_BUCKETS 12
+
+/* costs assumed by --dry-run where nothing was measured yet */
+#define PCAN_EST_RESET_US 250000
+#define PCAN_EST_DETACH_US 50000
+#define PCAN_EST_XFER_US 2000
+
+#define PCAN_TRACE_MAGIC "PCANTRC1"
+#define PCAN_SNAPSHOT_MAGIC "PCANSNP1"
+
+#define PCAN_SYSFS_USB "/sys/bus/usb/devices"
+#define PCAN_SYSFS_DEV_CHAR "/sys/dev/char"
+#define PCAN_DEV_BUS_USB "/dev/bus/usb"
+
+/* char device major of usbfs nodes, the minor is (bus - 1) * 128 + address - 1 */
+#define PCAN_USB_DEVICE_MAJOR 189
+
+/* bound for an adapter to come back after a reset made it re-enumerate */
+#define PCAN_REENUM_TIMEOUT_MS 5000
+#define PCAN_REENUM_POLL_MS 20
+
+#define PCAN_LOCK_DIR "/run/pcan-id"
+#define PCAN_LOCK_POLL_MS 10
+
+/* --serve socket, and how long it waits for a client that stopped sending */
+#define PCAN_SOCKET_PATH PCAN_LOCK_DIR "/pcan-id.sock"
+#define PCAN_SERVE_CLIENT_TIMEOUT_MS 5000
+
+/* first file descriptor passed by socket activation, SD_LISTEN_FDS_START */
+#define PCAN_LISTEN_FDS_START 3
+
+/* "<bus>-<port>.<port>...", at most 7 tiers of ports */
+#define PCAN_PORT_PATH_LEN 32
+
+#define PCAN_VENDOR_ID 0x0c72
+
+#define PCAN_MAX_CHANNELS 2
+
+#define PCAN_USB_EP_CMDOUT 0x01
+#define PCAN_USB_EP_CMDIN 0x81
+#define PCAN_USB_CMD_LEN 16
+
+/* PCAN-USB Pro: record based command messages */
+#define PCAN_USBPRO_EP_CMDOUT 0x01
+#define PCAN_USBPRO_EP_CMDIN 0x81
+#define PCAN_USBPRO_CMD_LEN 64
+#define PCAN_USBPRO_MSG_HEADER_LEN 4
+#define PCAN_USBPRO_REC_LEN 8
+#define PCAN_USBPRO_RSP_SUBMIT_MAX 2
+#define PCAN_USBPRO_SETDEVID 0x06
+#define PCAN_USBPRO_GETDEVID 0x12
+#define PCAN_USBPRO_REQ_INFO 0x01
+#define PCAN_USBPRO_INFO_BL 0
+#define PCAN_USBPRO_INFO_FW 1
+
+/* PCAN-USB FD family: uCAN command records, ids read from the fw info */
+#define PCAN_UFD_EP_CMDOUT 0x01
+#define PCAN_UFD_CMD_LEN 64
+#define PCAN_UFD_REC_LEN 8
+#define PCAN_UFD_CMD_DEVID_SET 0x81
+#define PCAN_UFD_FW_INFO_LEN 28
+#define PCAN_UFD_FW_INFO_DEVID_OFFSET 12
+#define PCAN_UFD_FW_INFO_SERIAL_OFFSET 20
+
+struct pcan_ctx;
+
+/*
+ * Protocol handlers of an adapter family. The device id accessors address
+ * all n channels of a device in a single exchange, set_device_ids() only
+ * writes channels whose bit is set in mask.
+ */
+struct pcan_proto {
+	char *name;
+	uint8_t ep_cmd_out;
+	uint8_t ep_cmd_in;
+	uint16_t cmd_len;
+	
+	int (*get_device_ids)(struct pcan_ctx *ctx, uint32_t *ids, int n);
+	int (*set_device_ids)(struct pcan_ctx *ctx, const uint32_t *ids, uint32_t mask, int n);
+	int (*get_serial)(struct pcan_ctx *ctx, uint32_t *serial_nr);
+	int (*set_serial)(struct pcan_ctx *ctx, uint32_t serial_nr);
+	
+	/* USB transfers of each accessor, for the --dry-run estimate */
+	uint8_t xfers_get_device_ids;
+	uint8_t xfers_set_device_ids;
+	uint8_t xfers_get_serial;
+	uint8_t xfers_set_serial;
+};
+
+static const struct pcan_proto pcan_usb_proto;
+static const struct pcan_proto pcan_usbpro_proto;
+static const struct pcan_proto pcan_usbfd_proto;
+
 struct pcan_type {
 	char *name;
 	uint16_t vendor_id;
 	uint16_t product_id;
+	uint8_t n_channels;
+	uint32_t device_id_max;
+	const struct pcan_proto *proto;
 };
 
+/* sorted by (vendor_id, product_id), see pcan_lookup_type() */
 struct pcan_type pcan_types[] = {
 	{
 		.name = "PCAN-USB",
-		.vendor_id = 0x0c72,
+		.vendor_id = PCAN_VENDOR_ID,
 		.product_id = 0x000c,
+		.n_channels = 1,
+		.device_id_max = UCHAR_MAX - 1,
+		.proto = &pcan_usb_proto,
+	},
+	{
+		.name = "PCAN-USB Pro",
+		.vendor_id = PCAN_VENDOR_ID,
+		.product_id = 0x000d,
+		.n_channels = 2,
+		.device_id_max = UINT32_MAX,
+		.proto = &pcan_usbpro_proto,
+	},
+	{
+		.name = "PCAN-USB Pro FD",
+		.vendor_id = PCAN_VENDOR_ID,
+		.product_id = 0x0011,
+		.n_channels = 2,
+		.device_id_max = UINT32_MAX,
+		.proto = &pcan_usbfd_proto,
+	},
+	{
+		.name = "PCAN-USB FD",
+		.vendor_id = PCAN_VENDOR_ID,
+		.product_id = 0x0012,
+		.n_channels = 1,
+		.device_id_max = UINT32_MAX,
+		.proto = &pcan_usbfd_proto,
+	},
+	{
+		.name = "PCAN-Chip USB",
+		.vendor_id = PCAN_VENDOR_ID,
+		.product_id = 0x0013,
+		.n_channels = 1,
+		.device_id_max = UINT32_MAX,
+		.proto = &pcan_usbfd_proto,
+	},
+	{
+		/* each of the three internal devices carries two channels */
+		.name = "PCAN-USB X6",
+		.vendor_id = PCAN_VENDOR_ID,
+		.product_id = 0x0014,
+		.n_channels = 2,
+		.device_id_max = UINT32_MAX,
+		.proto = &pcan_usbfd_proto,
 	},
 	
 	{0},
 };
 
+#define PCAN_N_TYPES (sizeof(pcan_types) / sizeof(pcan_types[0]) - 1)
+
+enum pcan_cmd_id {
+	PCAN_CMD_GET_DEVICE_ID,
+	PCAN_CMD_SET_DEVICE_ID,
+	PCAN_CMD_GET_SERIAL,
+	PCAN_CMD_SET_SERIAL,
+	
+	PCAN_CMD_MAX,
+};
+
+/*
+ * A command packet is PCAN_USB_CMD_LEN bytes long: opcode in pkt[0], sub-op
+ * in pkt[1] and the argument at pkt[offset]. Replies to "get" requests echo
+ * the opcode and carry the value at the same offset.
+ */
+struct pcan_cmd {
+	char *name;
+	uint8_t opcode;
+	uint8_t subop;
+	uint8_t offset;
+	uint8_t width;
+	uint8_t big_endian;
+	uint8_t has_reply;
+};
+
+static const struct pcan_cmd pcan_cmds[PCAN_CMD_MAX] = {
+	[PCAN_CMD_GET_DEVICE_ID] = {
+		.name = "get_device_id",
+		.opcode = 4,
+		.subop = 1,
+		.offset = 2,
+		.width = 1,
+		.has_reply = 1,
+	},
+	[PCAN_CMD_SET_DEVICE_ID] = {
+		.name = "set_device_id",
+		.opcode = 4,
+		.subop = 2,
+		.offset = 2,
+		.width = 1,
+	},
+	[PCAN_CMD_GET_SERIAL] = {
+		.name = "get_serial_number",
+		.opcode = 6,
+		.subop = 1,
+		.offset = 2,
+		.width = 4,
+		.has_reply = 1,
+	},
+	[PCAN_CMD_SET_SERIAL] = {
+		.name = "set_serial_number",
+		.opcode = 6,
+		.subop = 2,
+		.offset = 2,
+		.width = 4,
+	},
+};
+
+enum pcan_lock_mode {
+	PCAN_LOCK_WAIT,
+	PCAN_LOCK_TRY,
+	PCAN_LOCK_TIMEOUT,
+	PCAN_LOCK_NONE,
+};
+
+struct pcan_fleet;
+
+enum pcan_trace_type {
+	PCAN_TRACE_DEVICE = 1,
+	PCAN_TRACE_RESET,
+	PCAN_TRACE_TRANSFER,
+	PCAN_TRACE_POWER_CYCLE,
+};
+
+struct pcan_trace_rec {
+	uint8_t type;
+	uint8_t endpoint;
+	uint8_t xfer_type;
+	uint8_t bus;
+	int32_t status;
+	uint16_t vendor_id;
+	uint16_t product_id;
+	uint32_t length;
+	uint32_t actual_length;
+	uint32_t data_len;
+	uint64_t start_us;
+	uint64_t duration_us;
+	char port_path[PCAN_PORT_PATH_LEN];
+} __attribute__((packed));
+
+struct pcan_xfer {
+	struct libusb_transfer *transfer;
+	unsigned char buf[PCAN_XFER_BUF_LEN];
+	uint8_t busy;
+};
+
 struct pcan_ctx {
 	struct libusb_context *usb_ctx;
 	struct libusb_config_descriptor *config_descr;
@@ -60,8 +352,127 @@ struct pcan_ctx {
 	libusb_device_handle *dev_handle;
 	
 	struct pcan_type *pcan_type;
+	
+	char port_path[PCAN_PORT_PATH_LEN];
+	int lock_fd;
+	
+	uint8_t claimed;
+	uint8_t detached;
+	
+	struct pcan_xfer pool[PCAN_POOL_SIZE];
+	
+	/* last failed transfer, for pcan_recover_device() */
+	int xfer_error;
+	
+	/* output of this device, buffered per device in fleet mode */
+	FILE *out;
+	
+	/* USB string descriptors, empty until pcan_read_strings() */
+	char manufacturer[64];
+	char product[64];
+	
+	/* last identity read by pcan_query_identity(), see PCAN_IDENT_* */
+	uint32_t device_ids[PCAN_MAX_CHANNELS];
+	uint32_t serial_nr;
+	uint8_t ident_valid;
+	
+	/* served from a trace, see pcan_replay_attach() */
+	uint8_t replay;
+	size_t replay_pos;
+	
+	/* topology for the fleet scheduler */
+	struct pcan_fleet *fleet;
+	int bus;
+	int hub_idx;
+};
+
+#define PCAN_IDENT_DEVICE_IDS (1 << 0)
+#define PCAN_IDENT_SERIAL (1 << 1)
+#define PCAN_IDENT_SEEN (1 << 2)
+
+#define PCAN_JOB_MAX_OPS 8
+
+/* what to do with a device once it is opened, locked and claimed */
+struct pcan_job {
+	unsigned char action;
+	
+	/* -i, -s and -q in command line order, run in one claimed session */
+	unsigned char ops[PCAN_JOB_MAX_OPS];
+	int n_ops;
+	
+	uint32_t device_ids[PCAN_MAX_CHANNELS];
+	uint32_t device_id_mask;
+	uint32_t serial_nr;
+	
+	enum pcan_lock_mode lock_mode;
+	uint32_t lock_timeout_ms;
+	
+	/* roll back all fleet writes if one adapter fails */
+	uint8_t atomic;
+	
+	/* only print what would be written, see pcan_plan_job() */
+	uint8_t dry_run;
 };
 
+/*
+ * Set from signal context by SIGINT, SIGTERM, SIGHUP and by SIGALRM when the
+ * --deadline expires. Pending transfers are cancelled once it is non-zero.
+ */
+static volatile sig_atomic_t pcan_cancel_signal;
+
+#define PCAN_TYPE_KEY(vid, pid) (((uint32_t) (vid) << 16) | (pid))
+
+/* binary search in pcan_types[], all PEAK devices share one vendor id */
+static struct pcan_type *pcan_lookup_type(uint16_t vendor_id, uint16_t product_id)
+{
+	uint32_t key, k;
+	size_t lo, hi, mid;
+	
+	if (vendor_id != PCAN_VENDOR_ID)
+		return 0;
+	
+	key = PCAN_TYPE_KEY(vendor_id, product_id);
+	lo = 0;
+	hi = PCAN_N_TYPES;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		k = PCAN_TYPE_KEY(pcan_types[mid].vendor_id, pcan_types[mid].product_id);
+		if (k == key)
+			return &pcan_types[mid];
+		if (k < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	
+	return 0;
+}
+
+/* sysfs style topology path of a device, e.g. "1-2.3" */
+static int pcan_port_path(libusb_device *device, char *buf, size_t len)
+{
+	uint8_t ports[7];
+	int i, n, off;
+	
+	n = libusb_get_port_numbers(device, ports, sizeof(ports));
+	if (n < 0)
+		return n;
+	
+	off = snprintf(buf, len, "%u", libusb_get_bus_number(device));
+	for (i = 0; i < n && off < (int) len; i++)
+		off += snprintf(buf + off, len - off, "%c%u", i == 0 ? '-' : '.', ports[i]);
+	
+	return 0;
+}
+
+/* adapters attached without sysfs are named <bus>:<address>, see pcan_uevent_attach() */
+static int pcan_has_port_path(struct pcan_ctx *ctx)
+{
+	return strchr(ctx->port_path, '-') != 0;
+}
+
+static int pcan_replaying(void);
+static int pcan_replay_browse(struct pcan_ctx *ctx, uint8_t device_idx, uint8_t list_devices);
 
 static int browse_devices(struct pcan_ctx *ctx, uint8_t device_idx, libusb_device **device, libusb_device_handle **dev_handle, 
 						  struct pcan_type **pcan_type, uint8_t list_devices)
@@ -69,18 +480,23 @@ static int browse_devices(struct pcan_ctx *ctx, uint8_t device_idx, libusb_devic
 	struct pcan_type *p;
 	int r, i, c;
 	libusb_device **devices;
-	char supported;
 	
 	
+	*device = 0;
+	*pcan_type = 0;
+	*dev_handle = 0;
+	
+	if (pcan_replaying())
+		return pcan_replay_browse(ctx, device_idx, list_devices);
+	
+	PCAN_PROBE0(enumerate_start);
 	r = libusb_get_device_list(ctx->usb_ctx, &devices);
+	PCAN_PROBE1(enumerate_end, r);
 	if (r < 0) {
 		fprintf(stderr, "error retrieving list of devices: %s\n", libusb_strerror(r));
 		return 1;
 	}
 	
-	*device = 0;
-	*pcan_type = 0;
-	*dev_handle = 0;
 	c = 0;
 	i = 0;
 	while (devices[c]) {
@@ -90,17 +506,8 @@ static int browse_devices(struct pcan_ctx *ctx, uint8_t device_idx, libusb_devic
 			break;
 		}
 		
-		supported = 0;
-		for (p=pcan_types;p->name != 0; p++) {
-			if (p->vendor_id == ctx->dev_descr.idVendor &&
-				p->product_id == ctx->dev_descr.idProduct)
-			{
-				supported = 1;
-				break;
-			}
-		}
-		
-		if (supported) {
+		p = pcan_lookup_type(ctx->dev_descr.idVendor, ctx->dev_descr.idProduct);
+		if (p) {
 			if (list_devices) {
 				printf("%d: %04x:%04x Bus %03d Device %03d \"%s\"\n", i, ctx->dev_descr.idVendor, ctx->dev_descr.idProduct, 
 					   libusb_get_bus_number(devices[c]), libusb_get_device_address(devices[c]),
@@ -111,7 +518,10 @@ static int browse_devices(struct pcan_ctx *ctx, uint8_t device_idx, libusb_devic
 				*pcan_type = p;
 				*device = devices[c];
 				
+				pcan_port_path(devices[c], ctx->port_path, sizeof(ctx->port_path));
+				PCAN_PROBE1(open_start, ctx->port_path);
 				r = libusb_open(devices[c], dev_handle);
+				PCAN_PROBE2(open_end, ctx->port_path, r);
 				if (r < 0) {
 					printf("error opening device: %s\n", libusb_strerror(r));
 				}
@@ -122,289 +532,6227 @@ static int browse_devices(struct pcan_ctx *ctx, uint8_t device_idx, libusb_devic
 		c++;
 	}
 	
+	/* the list holds the only reference, keep one for the selected device */
+	if (*device)
+		libusb_ref_device(*device);
+	libusb_free_device_list(devices, 1);
+	
 	return 0;
 }
 
-void help(FILE *fd) {
-	fprintf(fd, "Usage: pcan-id [options]\n");
-	fprintf(fd, "\n");
-	fprintf(fd, "Options:\n");
-	fprintf(fd, "\n");
-	fprintf(fd, "-h           Show this help\n");
-	fprintf(fd, "-d <number>  Device index (default: 0)\n");
-	fprintf(fd, "-i <number>  Set device id\n");
-	fprintf(fd, "-l           List devices\n");	
-	fprintf(fd, "-q           Query serial number and device id\n");
-	fprintf(fd, "-s <number>  Set serial number\n");
-}
-
-char parse_long(char *arg, uint32_t *value) {
-	long long int val;
-	char *endptr;
+/*
+ * Take an advisory lock on the device's port path so that concurrent pcan-id
+ * runs never claim, reset or write the same adapter at the same time. The
+ * lock is dropped when lock_fd is closed, including on process exit.
+ */
+static int pcan_lock_device(struct pcan_ctx *ctx, enum pcan_lock_mode mode, unsigned int timeout_ms)
+{
+	char path[sizeof(PCAN_LOCK_DIR) + PCAN_PORT_PATH_LEN + 8];
+	struct timespec poll = { 0, PCAN_LOCK_POLL_MS * 1000000L };
+	unsigned int waited;
+	int fd, r;
 	
-	if ('0' <= arg[0] && arg[0] <= '9') {
-		if (arg[0] == '0' && arg[1] == 'x') {
-			val = strtoll(arg, &endptr, 16);
-		} else {
-			val = strtoll(arg, &endptr, 10);
-		}
-		
-		if (endptr) {
-			if (errno == ERANGE && (val == LLONG_MAX || val == LLONG_MIN)) {
-				fprintf(stderr, "range error\n");
-				return 1;
-			}
-			
-			if (errno != 0 && val == 0) {
-				fprintf(stderr, "No digits were found\n");
-				return 1;
-			}
-			
-			if (endptr == arg) {
-				fprintf(stderr, "No digits were found\n");
-				return 1;
-			}
-		}
-	} else {
-		fprintf(stderr, "invalid argument: %s\n", arg);
-		return 1;
-	}
+	/* still held across pcan_recover_device() */
+	if (ctx->lock_fd >= 0)
+		return 0;
 	
-	*value = val;
+	if (mode == PCAN_LOCK_NONE || ctx->replay)
+		return 0;
 	
-	return 0;
-}
-
-int main(int argc, char **argv) {
-	int r, opt;
-	uint32_t device_idx;
-	uint8_t device_id;
-	uint32_t serial_nr;
-	unsigned char pkt[16];
-	int transferred;
-	struct pcan_ctx *ctx;
-	uint32_t uint32;
+	if (mkdir(PCAN_LOCK_DIR, 0755) != 0 && errno != EEXIST) {
+		fprintf(stderr, "warning, cannot create %s, continuing without lock: %s\n", PCAN_LOCK_DIR, strerror(errno));
+		return 0;
+	}
 	
+	snprintf(path, sizeof(path), "%s/%s.lock", PCAN_LOCK_DIR, ctx->port_path);
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "warning, cannot open %s, continuing without lock: %s\n", path, strerror(errno));
+		return 0;
+	}
 	
-	device_idx = 0;
-	unsigned char action = 0;
-	while ((opt = getopt(argc, argv, "hi:s:d:lq")) != -1) {
-		switch (opt) {
-			case 'h':
-				help(stdout);
-				return 0;
-			case 'd':
-				if (parse_long(optarg, &device_idx))
-					exit(1);
-				
-				break;
-			case 's':
-				if (parse_long(optarg, &serial_nr))
-					exit(1);
-				
-				action = 's';
-				break;
-			case 'i':
-				if (parse_long(optarg, &uint32))
-					exit(1);
-				
-				if (uint32 >= UCHAR_MAX) {
-					fprintf(stderr, "invalid device id: %u < %u\n", uint32, UCHAR_MAX);
-					exit(1);
-				}
-				device_id = uint32;
-				
-				action = 'i';
-				break;
-			case 'l':
-				action = 'l';
-				break;
-			case 'q':
-				action = 'q';
+	PCAN_PROBE1(lock_start, ctx->port_path);
+	if (mode == PCAN_LOCK_WAIT) {
+		do {
+			r = flock(fd, LOCK_EX);
+		} while (r != 0 && errno == EINTR && !pcan_cancel_signal);
+	} else {
+		waited = 0;
+		while ((r = flock(fd, LOCK_EX | LOCK_NB)) != 0 && errno == EWOULDBLOCK) {
+			if (mode == PCAN_LOCK_TRY || waited >= timeout_ms || pcan_cancel_signal)
 				break;
-			default:
-				fprintf(stderr, "unknown option: %c\n", opt);
-				help(stderr);
-				return 1;
+			
+			nanosleep(&poll, 0);
+			waited += PCAN_LOCK_POLL_MS;
 		}
 	}
 	
-	if (action == 0) {
-		fprintf(stderr, "Please specify either -l, -s or -i.\n\n");
-		help(stderr);
+	PCAN_PROBE2(lock_end, ctx->port_path, r != 0 ? errno : 0);
+	if (r != 0) {
+		if (errno == EWOULDBLOCK)
+			fprintf(stderr, "error, device %s is in use by another process\n", ctx->port_path);
+		else
+			fprintf(stderr, "error locking %s: %s\n", path, strerror(errno));
+		close(fd);
 		return 1;
 	}
 	
-	ctx = malloc(sizeof(struct pcan_ctx));
+	ctx->lock_fd = fd;
 	
-	r = libusb_init(&ctx->usb_ctx);
-	if (r != 0) {
-		fprintf(stderr, "error initializing libusb\n");
-		free(ctx);
-		return 1;
+	return 0;
+}
+
+static void pcan_unlock_device(struct pcan_ctx *ctx)
+{
+	if (ctx->lock_fd >= 0) {
+		close(ctx->lock_fd);
+		ctx->lock_fd = -1;
 	}
+}
 
-	libusb_set_debug(ctx->usb_ctx, 3);
-	
-	r = browse_devices(ctx, device_idx, &ctx->device, &ctx->dev_handle, &ctx->pcan_type, (action == 'l'));
-	if (r != 0)
-		return r;
+/* write the request for cmd with argument value into the caller's buffer */
+static int pcan_encode(const struct pcan_cmd *cmd, unsigned char *pkt, size_t len, uint32_t value)
+{
+	int i;
 	
-	if (!ctx->dev_handle) {
-		fprintf(stderr, "error, requested device not found\n");
-		return 1;
-	}
+	if (len < PCAN_USB_CMD_LEN || cmd->offset + cmd->width > PCAN_USB_CMD_LEN)
+		return LIBUSB_ERROR_INVALID_PARAM;
 	
-	if (action == 'l')
-		return 0;
+	memset(pkt, 0, PCAN_USB_CMD_LEN);
+	pkt[0] = cmd->opcode;
+	pkt[1] = cmd->subop;
 	
-	#if defined(LIBUSBX_API_VERSION) && (LIBUSBX_API_VERSION >= 0x01000104)
-	libusb_set_auto_detach_kernel_driver(ctx->dev_handle, 1);
-	#endif
-	libusb_claim_interface(ctx->dev_handle, 0);
-	libusb_reset_device(ctx->dev_handle);
+	for (i = 0; i < cmd->width; i++) {
+		if (cmd->big_endian)
+			pkt[cmd->offset + cmd->width - 1 - i] = value >> (8 * i);
+		else
+			pkt[cmd->offset + i] = value >> (8 * i);
+	}
 	
+	return 0;
+}
+
+/* validate a reply to cmd in place and extract its value */
+static int pcan_decode(const struct pcan_cmd *cmd, const unsigned char *pkt, int transferred, uint32_t *value)
+{
+	uint32_t v;
+	int i;
 	
-	r = libusb_get_device_descriptor(ctx->device, &ctx->dev_descr);
-	if (r < 0) {
-		fprintf(stderr, "failed to get device descriptor: %s", libusb_strerror(r));
-		return 1;
+	if (transferred < cmd->offset + cmd->width) {
+		fprintf(stderr, "%s: short reply (%d bytes)\n", cmd->name, transferred);
+		return LIBUSB_ERROR_IO;
 	}
 	
-	r = libusb_get_config_descriptor(ctx->device, 0, &ctx->config_descr);
-	if (r != 0) {
-		fprintf(stderr, "error, get_config_descriptor failed\n");
-		return 1;
+	if (pkt[0] != cmd->opcode) {
+		fprintf(stderr, "%s: unexpected reply opcode %u\n", cmd->name, pkt[0]);
+		return LIBUSB_ERROR_IO;
 	}
 	
-	if (ctx->dev_descr.iManufacturer) {
-		char buf[64];
-		libusb_get_string_descriptor_ascii(ctx->dev_handle, ctx->dev_descr.iManufacturer, buf, sizeof(buf));
-		printf("%20s: %s\n", "iManufacturer", buf);
-	}
-	if (ctx->dev_descr.iProduct) {
-		char buf[64];
-		libusb_get_string_descriptor_ascii(ctx->dev_handle, ctx->dev_descr.iProduct, buf, sizeof(buf));
-		printf("%20s: %s\n", "iProduct", buf);
+	v = 0;
+	for (i = 0; i < cmd->width; i++) {
+		if (cmd->big_endian)
+			v |= (uint32_t) pkt[cmd->offset + cmd->width - 1 - i] << (8 * i);
+		else
+			v |= (uint32_t) pkt[cmd->offset + i] << (8 * i);
 	}
-	printf("\n");
-	
+	*value = v;
 	
-	if (action == 'i') {
-		memset(pkt, 0, sizeof(pkt));
-		pkt[0] = 4;
-		pkt[1] = 2;
-		pkt[2] = device_id;
-		
-		r = libusb_bulk_transfer(ctx->dev_handle,
-							0x1,
-							pkt,
-							sizeof(pkt),
-							&transferred,
-							USB_TIMEOUT_MS);
-		
+	return 0;
+}
+
+static void pcan_put_le16(unsigned char *p, uint16_t value)
+{
+	p[0] = value;
+	p[1] = value >> 8;
+}
+
+static void pcan_put_le32(unsigned char *p, uint32_t value)
+{
+	pcan_put_le16(p, value);
+	pcan_put_le16(p + 2, value >> 16);
+}
+
+static uint32_t pcan_get_le32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void pcan_signal_handler(int signo)
+{
+	pcan_cancel_signal = signo;
+}
+
+static void pcan_setup_signals(void)
+{
+	struct sigaction sa;
+	
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = pcan_signal_handler;
+	sigemptyset(&sa.sa_mask);
+	
+	/* no SA_RESTART, blocking calls like flock() have to return early */
+	sigaction(SIGINT, &sa, 0);
+	sigaction(SIGTERM, &sa, 0);
+	sigaction(SIGHUP, &sa, 0);
+	sigaction(SIGALRM, &sa, 0);
+}
+
+/* cancel the whole run with SIGALRM after timeout_ms */
+static void pcan_set_deadline(unsigned int timeout_ms)
+{
+	struct itimerval it;
+	
+	memset(&it, 0, sizeof(it));
+	it.it_value.tv_sec = timeout_ms / 1000;
+	it.it_value.tv_usec = (timeout_ms % 1000) * 1000;
+	setitimer(ITIMER_REAL, &it, 0);
+}
+
+/*
+ * The transfers of ctx, allocated on the first open and kept until
+ * pcan_release_device(), so reopening an adapter allocates nothing here.
+ * Commands on an open adapter make no heap allocations of their own; libusb
+ * still allocates its URBs on submit, and opening, sysfs directory reads
+ * and the output buffers of fleet jobs allocate as well.
+ */
+static int pcan_pool_init(struct pcan_ctx *ctx)
+{
+	int i;
+	
+	for (i = 0; i < PCAN_POOL_SIZE; i++) {
+		if (!ctx->pool[i].transfer)
+			ctx->pool[i].transfer = libusb_alloc_transfer(0);
+		if (!ctx->pool[i].transfer)
+			return LIBUSB_ERROR_NO_MEM;
+		ctx->pool[i].busy = 0;
+	}
+	
+	return 0;
+}
+
+static void pcan_pool_free(struct pcan_ctx *ctx)
+{
+	int i;
+	
+	for (i = 0; i < PCAN_POOL_SIZE; i++) {
+		if (ctx->pool[i].transfer)
+			libusb_free_transfer(ctx->pool[i].transfer);
+		ctx->pool[i].transfer = 0;
+	}
+}
+
+static struct pcan_xfer *pcan_pool_get(struct pcan_ctx *ctx)
+{
+	int i;
+	
+	for (i = 0; i < PCAN_POOL_SIZE; i++) {
+		if (ctx->pool[i].transfer && !ctx->pool[i].busy) {
+			ctx->pool[i].busy = 1;
+			return &ctx->pool[i];
+		}
+	}
+	
+	return 0;
+}
+
+static void pcan_pool_put(struct pcan_xfer *xfer)
+{
+	xfer->busy = 0;
+}
+
+/*
+ * Transfer statistics
+ *
+ * Every thread owns a cache line sized slot which only it writes to, the
+ * exporter sums up all slots. Updates are relaxed atomic adds on an
+ * uncontended line and cost next to nothing compared to a USB round-trip.
+ */
+
+static const uint32_t pcan_latency_bounds_us[PCAN_LATENCY_BUCKETS] = {
+	500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000, 1000000, 2000000,
+};
+
+struct pcan_stats_slot {
+	uint64_t transfers;
+	uint64_t errors;
+	uint64_t timeouts;
+	uint64_t resets;
+	uint64_t retries;
+	uint64_t latency_sum_us;
+	uint64_t latency_bucket[PCAN_LATENCY_BUCKETS + 1];
+} __attribute__((aligned(64)));
+
+static struct pcan_stats_slot pcan_stats[PCAN_STATS_SLOTS];
+static int pcan_stats_next;
+static __thread struct pcan_stats_slot *pcan_stats_self;
+
+#define PCAN_STAT_ADD(field, value) __atomic_fetch_add(&(field), (value), __ATOMIC_RELAXED)
+
+static uint64_t pcan_now_us(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* threads beyond PCAN_STATS_SLOTS share slots, which the atomic adds allow */
+static struct pcan_stats_slot *pcan_stats_slot(void)
+{
+	if (!pcan_stats_self)
+		pcan_stats_self = &pcan_stats[PCAN_STAT_ADD(pcan_stats_next, 1) % PCAN_STATS_SLOTS];
+	
+	return pcan_stats_self;
+}
+
+static void pcan_stats_transfer(int r, uint64_t latency_us)
+{
+	struct pcan_stats_slot *slot = pcan_stats_slot();
+	int b;
+	
+	PCAN_STAT_ADD(slot->transfers, 1);
+	if (r == LIBUSB_ERROR_TIMEOUT)
+		PCAN_STAT_ADD(slot->timeouts, 1);
+	else if (r != LIBUSB_SUCCESS)
+		PCAN_STAT_ADD(slot->errors, 1);
+	
+	for (b = 0; b < PCAN_LATENCY_BUCKETS && latency_us > pcan_latency_bounds_us[b]; b++)
+		;
+	PCAN_STAT_ADD(slot->latency_bucket[b], 1);
+	PCAN_STAT_ADD(slot->latency_sum_us, latency_us);
+}
+
+static void pcan_stats_reset(void)
+{
+	PCAN_STAT_ADD(pcan_stats_slot()->resets, 1);
+}
+
+static void pcan_stats_retry(void)
+{
+	PCAN_STAT_ADD(pcan_stats_slot()->retries, 1);
+}
+
+static void pcan_stats_sum(struct pcan_stats_slot *sum)
+{
+	int i, b;
+	
+	memset(sum, 0, sizeof(*sum));
+	for (i = 0; i < PCAN_STATS_SLOTS; i++) {
+		sum->transfers += __atomic_load_n(&pcan_stats[i].transfers, __ATOMIC_RELAXED);
+		sum->errors += __atomic_load_n(&pcan_stats[i].errors, __ATOMIC_RELAXED);
+		sum->timeouts += __atomic_load_n(&pcan_stats[i].timeouts, __ATOMIC_RELAXED);
+		sum->resets += __atomic_load_n(&pcan_stats[i].resets, __ATOMIC_RELAXED);
+		sum->retries += __atomic_load_n(&pcan_stats[i].retries, __ATOMIC_RELAXED);
+		sum->latency_sum_us += __atomic_load_n(&pcan_stats[i].latency_sum_us, __ATOMIC_RELAXED);
+		for (b = 0; b <= PCAN_LATENCY_BUCKETS; b++)
+			sum->latency_bucket[b] += __atomic_load_n(&pcan_stats[i].latency_bucket[b], __ATOMIC_RELAXED);
+	}
+}
+
+/* transfers in flight together, completed once the last one is done */
+struct pcan_wait {
+	int remaining;
+	int completed;
+	int failed;
+};
+
+static void LIBUSB_CALL pcan_transfer_cb(struct libusb_transfer *transfer)
+{
+	struct pcan_wait *wait = transfer->user_data;
+	
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+		__atomic_store_n(&wait->failed, 1, __ATOMIC_RELAXED);
+	if (__atomic_sub_fetch(&wait->remaining, 1, __ATOMIC_ACQ_REL) == 0)
+		__atomic_store_n(&wait->completed, 1, __ATOMIC_RELEASE);
+}
+
+/* bRequest of control transfers, otherwise the first (opcode) byte */
+static inline int pcan_transfer_opcode(struct libusb_transfer *transfer)
+{
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+		return transfer->buffer[1];
+	
+	return transfer->length > 0 ? transfer->buffer[0] : -1;
+}
+
+/*
+ * Record and replay
+ *
+ * A trace starts with PCAN_TRACE_MAGIC followed by records, each a struct
+ * pcan_trace_rec in host byte order and data_len bytes of payload: the data
+ * sent for OUT transfers, the data received for IN transfers and the setup
+ * packet plus data for control transfers. Replaying serves the recorded
+ * responses per port path in their original order, optionally with the
+ * recorded timing scaled by --replay-speed.
+ */
+
+struct pcan_trace_entry {
+	struct pcan_trace_rec rec;
+	const unsigned char *data;
+};
+
+struct pcan_trace {
+	/* recording */
+	FILE *f;
+	pthread_mutex_t lock;
+	uint64_t t0_us;
+	
+	/* replaying */
+	unsigned char *buf;
+	struct pcan_trace_entry *entries;
+	size_t n_entries;
+	double speed;
+};
+
+static struct pcan_trace pcan_trace = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int pcan_trace_open(const char *path)
+{
+	pcan_trace.f = fopen(path, "wb");
+	if (!pcan_trace.f || fwrite(PCAN_TRACE_MAGIC, 8, 1, pcan_trace.f) != 1) {
+		fprintf(stderr, "error, cannot write %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	pcan_trace.t0_us = pcan_now_us();
+	
+	return 0;
+}
+
+static void pcan_trace_close(void)
+{
+	if (pcan_trace.f)
+		fclose(pcan_trace.f);
+	pcan_trace.f = 0;
+	
+	free(pcan_trace.entries);
+	free(pcan_trace.buf);
+	pcan_trace.entries = 0;
+	pcan_trace.buf = 0;
+	pcan_trace.n_entries = 0;
+}
+
+static void pcan_trace_write(struct pcan_trace_rec *rec, const unsigned char *data)
+{
+	pthread_mutex_lock(&pcan_trace.lock);
+	fwrite(rec, sizeof(*rec), 1, pcan_trace.f);
+	if (rec->data_len)
+		fwrite(data, rec->data_len, 1, pcan_trace.f);
+	pthread_mutex_unlock(&pcan_trace.lock);
+}
+
+static void pcan_trace_fill(struct pcan_trace_rec *rec, struct pcan_ctx *ctx, uint8_t type, int status, uint64_t start_us, uint64_t end_us)
+{
+	memset(rec, 0, sizeof(*rec));
+	rec->type = type;
+	rec->status = status;
+	rec->start_us = start_us - pcan_trace.t0_us;
+	rec->duration_us = end_us - start_us;
+	memcpy(rec->port_path, ctx->port_path, sizeof(rec->port_path));
+}
+
+static void pcan_trace_device(struct pcan_ctx *ctx)
+{
+	struct pcan_trace_rec rec;
+	uint64_t now;
+	
+	if (!pcan_trace.f)
+		return;
+	
+	now = pcan_now_us();
+	pcan_trace_fill(&rec, ctx, PCAN_TRACE_DEVICE, 0, now, now);
+	rec.bus = ctx->bus;
+	rec.vendor_id = ctx->pcan_type->vendor_id;
+	rec.product_id = ctx->pcan_type->product_id;
+	pcan_trace_write(&rec, 0);
+}
+
+/* a reset or power cycle of ctx */
+static void pcan_trace_event(struct pcan_ctx *ctx, uint8_t type, int status, uint64_t start_us)
+{
+	struct pcan_trace_rec rec;
+	
+	if (!pcan_trace.f)
+		return;
+	
+	pcan_trace_fill(&rec, ctx, type, status, start_us, pcan_now_us());
+	pcan_trace_write(&rec, 0);
+}
+
+static void pcan_trace_transfer(struct pcan_ctx *ctx, struct libusb_transfer *transfer, int status, uint64_t start_us, uint64_t end_us)
+{
+	struct pcan_trace_rec rec;
+	
+	if (!pcan_trace.f)
+		return;
+	
+	pcan_trace_fill(&rec, ctx, PCAN_TRACE_TRANSFER, status, start_us, end_us);
+	rec.endpoint = transfer->endpoint;
+	rec.xfer_type = transfer->type;
+	rec.length = transfer->length;
+	rec.actual_length = transfer->actual_length;
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+		rec.data_len = LIBUSB_CONTROL_SETUP_SIZE + transfer->actual_length;
+	else if (transfer->endpoint & LIBUSB_ENDPOINT_IN)
+		rec.data_len = transfer->actual_length;
+	else
+		rec.data_len = transfer->length;
+	pcan_trace_write(&rec, transfer->buffer);
+}
+
+static int pcan_replay_load(const char *path, double speed)
+{
+	struct pcan_trace_entry *entries;
+	size_t len, off, n;
+	unsigned char *buf;
+	FILE *f;
+	long size;
+	
+	f = fopen(path, "rb");
+	if (!f || fseek(f, 0, SEEK_END) != 0 || (size = ftell(f)) < 8 || fseek(f, 0, SEEK_SET) != 0) {
+		fprintf(stderr, "error, cannot read %s\n", path);
+		if (f)
+			fclose(f);
+		return 1;
+	}
+	len = size;
+	
+	buf = malloc(len);
+	entries = calloc(len / sizeof(struct pcan_trace_rec) + 1, sizeof(*entries));
+	if (!buf || !entries || fread(buf, len, 1, f) != 1) {
+		fprintf(stderr, "error, cannot read %s\n", path);
+		fclose(f);
+		goto fail;
+	}
+	fclose(f);
+	
+	if (memcmp(buf, PCAN_TRACE_MAGIC, 8)) {
+		fprintf(stderr, "error, %s is not a pcan-id trace\n", path);
+		goto fail;
+	}
+	
+	n = 0;
+	off = 8;
+	while (off + sizeof(struct pcan_trace_rec) <= len) {
+		memcpy(&entries[n].rec, buf + off, sizeof(struct pcan_trace_rec));
+		off += sizeof(struct pcan_trace_rec);
+		if (entries[n].rec.data_len > len - off)
+			break;
+		
+		entries[n].rec.port_path[PCAN_PORT_PATH_LEN - 1] = 0;
+		entries[n].data = buf + off;
+		off += entries[n].rec.data_len;
+		n++;
+	}
+	if (off != len)
+		fprintf(stderr, "warning, ignoring truncated record at the end of %s\n", path);
+	
+	pcan_trace.buf = buf;
+	pcan_trace.entries = entries;
+	pcan_trace.n_entries = n;
+	pcan_trace.speed = speed;
+	
+	return 0;
+	
+fail:
+	free(entries);
+	free(buf);
+	
+	return 1;
+}
+
+static int pcan_replaying(void)
+{
+	return pcan_trace.entries != 0;
+}
+
+/* the idx-th distinct device of the trace */
+static struct pcan_trace_rec *pcan_replay_device(int idx)
+{
+	size_t i, j;
+	
+	for (i = 0; i < pcan_trace.n_entries; i++) {
+		if (pcan_trace.entries[i].rec.type != PCAN_TRACE_DEVICE)
+			continue;
+		
+		for (j = 0; j < i; j++) {
+			if (pcan_trace.entries[j].rec.type == PCAN_TRACE_DEVICE &&
+				!strcmp(pcan_trace.entries[j].rec.port_path, pcan_trace.entries[i].rec.port_path))
+				break;
+		}
+		if (j < i)
+			continue;
+		
+		if (idx-- == 0)
+			return &pcan_trace.entries[i].rec;
+	}
+	
+	return 0;
+}
+
+/* set up ctx to be served from the trace, returns non-zero for unknown devices */
+static int pcan_replay_attach(struct pcan_ctx *ctx, struct pcan_trace_rec *rec)
+{
+	ctx->pcan_type = pcan_lookup_type(rec->vendor_id, rec->product_id);
+	if (!ctx->pcan_type)
+		return 1;
+	
+	ctx->replay = 1;
+	ctx->replay_pos = 0;
+	ctx->bus = rec->bus;
+	memcpy(ctx->port_path, rec->port_path, sizeof(ctx->port_path));
+	
+	return 0;
+}
+
+/* next event of type for ctx's port path, NULL once the trace is exhausted */
+static struct pcan_trace_entry *pcan_replay_next(struct pcan_ctx *ctx, uint8_t type)
+{
+	struct pcan_trace_entry *e;
+	
+	for (; ctx->replay_pos < pcan_trace.n_entries; ctx->replay_pos++) {
+		e = &pcan_trace.entries[ctx->replay_pos];
+		if (e->rec.type == type && !strcmp(e->rec.port_path, ctx->port_path)) {
+			ctx->replay_pos++;
+			return e;
+		}
+	}
+	
+	fprintf(stderr, "replay: no more recorded events for %s\n", ctx->port_path);
+	
+	return 0;
+}
+
+static void pcan_replay_delay(uint64_t duration_us)
+{
+	struct timespec ts;
+	uint64_t us;
+	
+	if (pcan_trace.speed <= 0)
+		return;
+	
+	us = duration_us / pcan_trace.speed;
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	nanosleep(&ts, 0);
+}
+
+static int pcan_replay_transfer(struct pcan_ctx *ctx, struct libusb_transfer *transfer)
+{
+	struct pcan_trace_entry *e;
+	uint32_t len;
+	
+	e = pcan_replay_next(ctx, PCAN_TRACE_TRANSFER);
+	if (!e)
+		return LIBUSB_ERROR_IO;
+	
+	if (e->rec.endpoint != transfer->endpoint || e->rec.xfer_type != transfer->type) {
+		fprintf(stderr, "replay: %s diverged, expected endpoint 0x%02x, got 0x%02x\n",
+			   ctx->port_path, e->rec.endpoint, transfer->endpoint);
+		return LIBUSB_ERROR_IO;
+	}
+	
+	pcan_replay_delay(e->rec.duration_us);
+	
+	len = e->rec.actual_length;
+	if (len > (uint32_t) transfer->length)
+		len = transfer->length;
+	
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
+		if (e->rec.data_len >= LIBUSB_CONTROL_SETUP_SIZE + len)
+			memcpy(transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE, e->data + LIBUSB_CONTROL_SETUP_SIZE, len);
+	} else if (transfer->endpoint & LIBUSB_ENDPOINT_IN) {
+		if (e->rec.data_len >= len)
+			memcpy(transfer->buffer, e->data, len);
+	}
+	transfer->actual_length = len;
+	
+	return e->rec.status;
+}
+
+static int pcan_replay_event(struct pcan_ctx *ctx, uint8_t type)
+{
+	struct pcan_trace_entry *e;
+	
+	e = pcan_replay_next(ctx, type);
+	if (!e)
+		return LIBUSB_ERROR_IO;
+	
+	pcan_replay_delay(e->rec.duration_us);
+	
+	return e->rec.status;
+}
+
+/* browse_devices() on the devices of the trace */
+static int pcan_replay_browse(struct pcan_ctx *ctx, uint8_t device_idx, uint8_t list_devices)
+{
+	struct pcan_trace_rec *rec;
+	int i;
+	
+	for (i = 0; (rec = pcan_replay_device(i)); i++) {
+		if (list_devices) {
+			struct pcan_type *p = pcan_lookup_type(rec->vendor_id, rec->product_id);
+			
+			printf("%d: %04x:%04x Bus %03d Path %s \"%s\" (replay)\n", i, rec->vendor_id, rec->product_id,
+				   rec->bus, rec->port_path, p ? p->name : "unknown");
+		}
+		
+		if (i == device_idx)
+			pcan_replay_attach(ctx, rec);
+	}
+	
+	return 0;
+}
+
+static int pcan_transfer_result(struct libusb_transfer *transfer)
+{
+	switch (transfer->status) {
+		case LIBUSB_TRANSFER_COMPLETED:
+			return LIBUSB_SUCCESS;
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			return LIBUSB_ERROR_TIMEOUT;
+		case LIBUSB_TRANSFER_CANCELLED:
+			return LIBUSB_ERROR_INTERRUPTED;
+		case LIBUSB_TRANSFER_STALL:
+			return LIBUSB_ERROR_PIPE;
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			return LIBUSB_ERROR_NO_DEVICE;
+		case LIBUSB_TRANSFER_OVERFLOW:
+			return LIBUSB_ERROR_OVERFLOW;
+		default:
+			return LIBUSB_ERROR_IO;
+	}
+}
+
+static void pcan_cancel_all(struct libusb_transfer **transfers, int n)
+{
+	int i;
+	
+	for (i = 0; i < n; i++)
+		libusb_cancel_transfer(transfers[i]);
+}
+
+/*
+ * Submit the n transfers and wait until all of them completed, honouring
+ * cancellation. Reads are posted before writes, so the reply to a command
+ * is picked up in the first frame after the device has it ready. Returns
+ * the result of the first transfer that failed.
+ */
+static int pcan_usb_wait(struct pcan_ctx *ctx, struct libusb_transfer **transfers, int n)
+{
+	struct pcan_wait wait;
+	struct timeval tv;
+	int i, pass, r, submitted, cancelled;
+	
+	wait.remaining = n;
+	wait.completed = 0;
+	wait.failed = 0;
+	submitted = 0;
+	r = 0;
+	for (pass = 0; pass < 2 && r == 0; pass++) {
+		for (i = 0; i < n && r == 0; i++) {
+			if (((transfers[i]->endpoint & LIBUSB_ENDPOINT_IN) != 0) == pass)
+				continue;
+			
+			transfers[i]->user_data = &wait;
+			transfers[i]->callback = pcan_transfer_cb;
+			transfers[i]->actual_length = 0;
+			r = libusb_submit_transfer(transfers[i]);
+			if (r == 0)
+				submitted++;
+		}
+	}
+	
+	cancelled = 0;
+	if (r < 0) {
+		if (submitted == 0)
+			return r;
+		
+		/* reap what is in flight already */
+		if (__atomic_sub_fetch(&wait.remaining, n - submitted, __ATOMIC_ACQ_REL) == 0)
+			__atomic_store_n(&wait.completed, 1, __ATOMIC_RELEASE);
+		pcan_cancel_all(transfers, n);
+		cancelled = 1;
+	}
+	
+	while (!__atomic_load_n(&wait.completed, __ATOMIC_ACQUIRE)) {
+		/* a reply will not come if its command failed */
+		if ((pcan_cancel_signal || __atomic_load_n(&wait.failed, __ATOMIC_RELAXED)) && !cancelled) {
+			pcan_cancel_all(transfers, n);
+			cancelled = 1;
+		}
+		
+		tv.tv_sec = 0;
+		tv.tv_usec = PCAN_CANCEL_POLL_MS * 1000;
+		i = libusb_handle_events_timeout_completed(ctx->usb_ctx, &tv, &wait.completed);
+		if (i < 0 && i != LIBUSB_ERROR_INTERRUPTED && !cancelled) {
+			pcan_cancel_all(transfers, n);
+			cancelled = 1;
+		}
+	}
+	
+	if (r < 0)
+		return r;
+	
+	for (i = 0; i < n; i++) {
+		r = pcan_transfer_result(transfers[i]);
 		if (r != LIBUSB_SUCCESS)
-			printf("error %s\n", libusb_error_name(r));
+			return r;
 	}
 	
-	if (action == 's') {
-		memset(pkt, 0, sizeof(pkt));
-		pkt[0] = 6;
-		pkt[1] = 2;
-		
-		serial_nr = htole32(serial_nr);
-		memcpy(&pkt[2], &serial_nr, sizeof(serial_nr));
-		
-		r = libusb_bulk_transfer(ctx->dev_handle,
-							0x1,
-							pkt,
-							sizeof(pkt),
-							&transferred,
-							USB_TIMEOUT_MS);
-		
-		if (r != LIBUSB_SUCCESS)
-			printf("error %s\n", libusb_error_name(r));
-	}
+	return LIBUSB_SUCCESS;
+}
+
+/*
+ * Submit the n transfers and run the event loop until all completed. If the
+ * run is cancelled meanwhile, the transfers are cancelled and still reaped
+ * before returning so that the interface can be released safely. In replay
+ * mode the responses come from the trace instead, in the order given.
+ */
+static int pcan_submit_and_wait(struct pcan_ctx *ctx, struct libusb_transfer **transfers, int n)
+{
+	uint64_t start_us, end_us;
+	int i, r, ri;
+	
+	if (pcan_cancel_signal)
+		return LIBUSB_ERROR_INTERRUPTED;
+	
+	for (i = 0; i < n; i++)
+		PCAN_PROBE4(transfer_start, ctx->port_path, transfers[i]->endpoint, pcan_transfer_opcode(transfers[i]), transfers[i]->length);
+	start_us = pcan_now_us();
+	
+	if (ctx->replay) {
+		r = LIBUSB_SUCCESS;
+		for (i = 0; i < n && r == LIBUSB_SUCCESS; i++) {
+			r = pcan_replay_transfer(ctx, transfers[i]);
+			end_us = pcan_now_us();
+			pcan_stats_transfer(r, end_us - start_us);
+			pcan_trace_transfer(ctx, transfers[i], r, start_us, end_us);
+			PCAN_PROBE5(transfer_end, ctx->port_path, transfers[i]->endpoint, pcan_transfer_opcode(transfers[i]), transfers[i]->actual_length, r);
+			start_us = end_us;
+		}
+		if (r < 0)
+			ctx->xfer_error = r;
+		
+		return r;
+	}
+	
+	r = pcan_usb_wait(ctx, transfers, n);
+	if (r < 0)
+		ctx->xfer_error = r;
+	
+	end_us = pcan_now_us();
+	for (i = 0; i < n; i++) {
+		ri = pcan_transfer_result(transfers[i]);
+		pcan_stats_transfer(ri, end_us - start_us);
+		pcan_trace_transfer(ctx, transfers[i], ri, start_us, end_us);
+		PCAN_PROBE5(transfer_end, ctx->port_path, transfers[i]->endpoint, pcan_transfer_opcode(transfers[i]), transfers[i]->actual_length, ri);
+	}
+	
+	return r;
+}
+
+/* bulk transfer on the caller's buffer using a pooled transfer */
+static int pcan_bulk(struct pcan_ctx *ctx, uint8_t endpoint, unsigned char *buf, int len, int *transferred)
+{
+	struct pcan_xfer *xfer;
+	int r;
+	
+	xfer = pcan_pool_get(ctx);
+	if (!xfer)
+		return LIBUSB_ERROR_BUSY;
+	
+	libusb_fill_bulk_transfer(xfer->transfer, ctx->dev_handle, endpoint, buf, len, 0, 0, USB_TIMEOUT_MS);
+	
+	r = pcan_submit_and_wait(ctx, &xfer->transfer, 1);
+	*transferred = xfer->transfer->actual_length;
+	pcan_pool_put(xfer);
+	
+	if (r != LIBUSB_SUCCESS)
+		fprintf(ctx->out, "error %s\n", libusb_error_name(r));
+	
+	return r;
+}
+
+/* send cmd and receive the reply with both transfers in flight together */
+static int pcan_bulk_xchg(struct pcan_ctx *ctx, unsigned char *cmd, int cmd_len, unsigned char *reply, int reply_len, int *transferred)
+{
+	const struct pcan_proto *proto = ctx->pcan_type->proto;
+	struct libusb_transfer *transfers[2];
+	struct pcan_xfer *out, *in;
+	int r;
+	
+	if (reply_len > PCAN_XFER_BUF_LEN)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	
+	out = pcan_pool_get(ctx);
+	in = pcan_pool_get(ctx);
+	if (!out || !in) {
+		if (out)
+			pcan_pool_put(out);
+		if (in)
+			pcan_pool_put(in);
+		return LIBUSB_ERROR_BUSY;
+	}
+	
+	libusb_fill_bulk_transfer(out->transfer, ctx->dev_handle, proto->ep_cmd_out, cmd, cmd_len, 0, 0, USB_TIMEOUT_MS);
+	libusb_fill_bulk_transfer(in->transfer, ctx->dev_handle, proto->ep_cmd_in, in->buf, reply_len, 0, 0, USB_TIMEOUT_MS);
+	transfers[0] = out->transfer;
+	transfers[1] = in->transfer;
+	
+	r = pcan_submit_and_wait(ctx, transfers, 2);
+	*transferred = in->transfer->actual_length;
+	if (r == LIBUSB_SUCCESS)
+		memcpy(reply, in->buf, *transferred);
+	pcan_pool_put(in);
+	pcan_pool_put(out);
+	
+	if (r != LIBUSB_SUCCESS)
+		fprintf(ctx->out, "error %s\n", libusb_error_name(r));
+	
+	return r;
+}
+
+/* vendor request on the control endpoint, returns the number of bytes read */
+static int pcan_ctrl_in(struct pcan_ctx *ctx, uint8_t request, uint16_t value, unsigned char *buf, uint16_t len)
+{
+	struct pcan_xfer *xfer;
+	int r;
+	
+	if (len > PCAN_XFER_BUF_LEN - LIBUSB_CONTROL_SETUP_SIZE)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	
+	xfer = pcan_pool_get(ctx);
+	if (!xfer)
+		return LIBUSB_ERROR_BUSY;
+	
+	libusb_fill_control_setup(xfer->buf,
+						LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_OTHER,
+						request,
+						value,
+						0,
+						len);
+	libusb_fill_control_transfer(xfer->transfer, ctx->dev_handle, xfer->buf, 0, 0, USB_TIMEOUT_MS);
+	
+	r = pcan_submit_and_wait(ctx, &xfer->transfer, 1);
+	if (r == LIBUSB_SUCCESS) {
+		memcpy(buf, libusb_control_transfer_get_data(xfer->transfer), xfer->transfer->actual_length);
+		r = xfer->transfer->actual_length;
+	}
+	pcan_pool_put(xfer);
+	
+	if (r < 0)
+		fprintf(ctx->out, "error %s\n", libusb_error_name(r));
+	
+	return r;
+}
+
+/*
+ * Claim interface 0 for exclusive use. The kernel driver is detached
+ * automatically where libusb supports it and by hand otherwise, in both
+ * cases pcan_close_device() gives the interface back to it.
+ */
+static int pcan_claim_device(struct pcan_ctx *ctx)
+{
+	int r;
+	
+	if (ctx->replay)
+		return 0;
+	
+	#if defined(LIBUSBX_API_VERSION) && (LIBUSBX_API_VERSION >= 0x01000104)
+	libusb_set_auto_detach_kernel_driver(ctx->dev_handle, 1);
+	#else
+	if (libusb_kernel_driver_active(ctx->dev_handle, 0) == 1) {
+		r = libusb_detach_kernel_driver(ctx->dev_handle, 0);
+		if (r != LIBUSB_SUCCESS) {
+			fprintf(stderr, "error detaching kernel driver: %s\n", libusb_strerror(r));
+			return r;
+		}
+		ctx->detached = 1;
+	}
+	#endif
+	
+	PCAN_PROBE1(claim_start, ctx->port_path);
+	r = libusb_claim_interface(ctx->dev_handle, 0);
+	PCAN_PROBE2(claim_end, ctx->port_path, r);
+	if (r != LIBUSB_SUCCESS) {
+		fprintf(stderr, "error claiming interface: %s\n", libusb_strerror(r));
+		return r;
+	}
+	ctx->claimed = 1;
+	
+	return 0;
+}
+
+/* release the interface and give it back to the kernel driver */
+static void pcan_unclaim_device(struct pcan_ctx *ctx)
+{
+	if (ctx->dev_handle) {
+		if (ctx->claimed) {
+			PCAN_PROBE1(release, ctx->port_path);
+			libusb_release_interface(ctx->dev_handle, 0);
+		}
+		if (ctx->detached)
+			libusb_attach_kernel_driver(ctx->dev_handle, 0);
+	}
+	ctx->claimed = 0;
+	ctx->detached = 0;
+}
+
+/* release the interface, reattach the kernel driver and close, the lock stays */
+static void pcan_close_handle(struct pcan_ctx *ctx)
+{
+	pcan_unclaim_device(ctx);
+	
+	if (ctx->dev_handle) {
+		libusb_close(ctx->dev_handle);
+		ctx->dev_handle = 0;
+	}
+	
+	if (ctx->config_descr) {
+		libusb_free_config_descriptor(ctx->config_descr);
+		ctx->config_descr = 0;
+	}
+}
+
+/* pcan_close_handle() and unlock */
+static void pcan_close_device(struct pcan_ctx *ctx)
+{
+	pcan_close_handle(ctx);
+	pcan_unlock_device(ctx);
+}
+
+/* pcan_close_device(), free the transfers and drop the reference on the libusb device */
+static void pcan_release_device(struct pcan_ctx *ctx)
+{
+	pcan_close_device(ctx);
+	pcan_pool_free(ctx);
+	
+	if (ctx->device) {
+		libusb_unref_device(ctx->device);
+		ctx->device = 0;
+	}
+}
+
+/* send command cmd_id and, if it has one, wait for and decode its reply */
+static int pcan_exec(struct pcan_ctx *ctx, enum pcan_cmd_id cmd_id, uint32_t *value)
+{
+	const struct pcan_proto *proto = ctx->pcan_type->proto;
+	const struct pcan_cmd *cmd = &pcan_cmds[cmd_id];
+	unsigned char pkt[PCAN_USB_CMD_LEN];
+	int r, transferred;
+	
+	/* a request for a reply carries no value, *value is only written */
+	r = pcan_encode(cmd, pkt, sizeof(pkt), cmd->has_reply ? 0 : *value);
+	if (r != 0)
+		return r;
+	
+	if (!cmd->has_reply)
+		return pcan_bulk(ctx, proto->ep_cmd_out, pkt, sizeof(pkt), &transferred);
+	
+	r = pcan_bulk_xchg(ctx, pkt, sizeof(pkt), pkt, sizeof(pkt), &transferred);
+	if (r != LIBUSB_SUCCESS)
+		return r;
+	
+	return pcan_decode(cmd, pkt, transferred, value);
+}
+
+
+/*
+ * PCAN-USB
+ */
+
+static int pcan_usb_get_device_ids(struct pcan_ctx *ctx, uint32_t *ids, int n)
+{
+	/* single channel */
+	(void) n;
+	
+	return pcan_exec(ctx, PCAN_CMD_GET_DEVICE_ID, &ids[0]);
+}
+
+static int pcan_usb_set_device_ids(struct pcan_ctx *ctx, const uint32_t *ids, uint32_t mask, int n)
+{
+	uint32_t value = ids[0];
+	
+	(void) n;
+	if (!(mask & 1))
+		return 0;
+	
+	return pcan_exec(ctx, PCAN_CMD_SET_DEVICE_ID, &value);
+}
+
+static int pcan_usb_get_serial(struct pcan_ctx *ctx, uint32_t *serial_nr)
+{
+	return pcan_exec(ctx, PCAN_CMD_GET_SERIAL, serial_nr);
+}
+
+static int pcan_usb_set_serial(struct pcan_ctx *ctx, uint32_t serial_nr)
+{
+	return pcan_exec(ctx, PCAN_CMD_SET_SERIAL, &serial_nr);
+}
+
+static const struct pcan_proto pcan_usb_proto = {
+	.name = "pcan_usb",
+	.ep_cmd_out = PCAN_USB_EP_CMDOUT,
+	.ep_cmd_in = PCAN_USB_EP_CMDIN,
+	.cmd_len = PCAN_USB_CMD_LEN,
+	.get_device_ids = pcan_usb_get_device_ids,
+	.set_device_ids = pcan_usb_set_device_ids,
+	.get_serial = pcan_usb_get_serial,
+	.set_serial = pcan_usb_set_serial,
+	.xfers_get_device_ids = 2,
+	.xfers_set_device_ids = 1,
+	.xfers_get_serial = 2,
+	.xfers_set_serial = 1,
+};
+
+
+/*
+ * PCAN-USB Pro
+ *
+ * A message starts with a le32 record count followed by one 8 byte record
+ * per channel: data type, channel, two reserved bytes and a le32 argument.
+ */
+
+static int pcan_usbpro_build(unsigned char *msg, uint8_t data_type, const uint32_t *ids, uint32_t mask, int n)
+{
+	unsigned char *rec;
+	int ch, rec_cnt;
+	
+	memset(msg, 0, PCAN_USBPRO_CMD_LEN);
+	
+	rec_cnt = 0;
+	for (ch = 0; ch < n; ch++) {
+		if (!(mask & (1 << ch)))
+			continue;
+		
+		rec = msg + PCAN_USBPRO_MSG_HEADER_LEN + rec_cnt * PCAN_USBPRO_REC_LEN;
+		rec[0] = data_type;
+		rec[1] = ch;
+		pcan_put_le32(rec + 4, ids ? ids[ch] : 0);
+		rec_cnt++;
+	}
+	pcan_put_le32(msg, rec_cnt);
+	
+	return PCAN_USBPRO_MSG_HEADER_LEN + rec_cnt * PCAN_USBPRO_REC_LEN;
+}
+
+static int pcan_usbpro_get_device_ids(struct pcan_ctx *ctx, uint32_t *ids, int n)
+{
+	const struct pcan_proto *proto = ctx->pcan_type->proto;
+	unsigned char msg[PCAN_USBPRO_CMD_LEN];
+	unsigned char *rec;
+	uint32_t all, answered, rec_cnt, i;
+	int r, len, submit, transferred;
+	
+	all = (1 << n) - 1;
+	len = pcan_usbpro_build(msg, PCAN_USBPRO_GETDEVID, 0, all, n);
+	
+	answered = 0;
+	for (submit = 0; submit < PCAN_USBPRO_RSP_SUBMIT_MAX && answered != all; submit++) {
+		/* the first read is posted together with the request */
+		if (submit == 0)
+			r = pcan_bulk_xchg(ctx, msg, len, msg, sizeof(msg), &transferred);
+		else
+			r = pcan_bulk(ctx, proto->ep_cmd_in, msg, sizeof(msg), &transferred);
+		if (r != LIBUSB_SUCCESS)
+			return r;
+		
+		if (transferred < PCAN_USBPRO_MSG_HEADER_LEN)
+			continue;
+		
+		rec_cnt = pcan_get_le32(msg);
+		for (i = 0; i < rec_cnt; i++) {
+			rec = msg + PCAN_USBPRO_MSG_HEADER_LEN + i * PCAN_USBPRO_REC_LEN;
+			if (rec + PCAN_USBPRO_REC_LEN > msg + transferred)
+				break;
+			
+			/* records of other types have different sizes */
+			if (rec[0] != PCAN_USBPRO_GETDEVID)
+				break;
+			
+			if (rec[1] < n) {
+				ids[rec[1]] = pcan_get_le32(rec + 4);
+				answered |= 1 << rec[1];
+			}
+		}
+	}
+	
+	if (answered != all) {
+		fprintf(stderr, "%s: incomplete device id reply\n", proto->name);
+		return LIBUSB_ERROR_IO;
+	}
+	
+	return 0;
+}
+
+static int pcan_usbpro_set_device_ids(struct pcan_ctx *ctx, const uint32_t *ids, uint32_t mask, int n)
+{
+	unsigned char msg[PCAN_USBPRO_CMD_LEN];
+	int len, transferred;
+	
+	len = pcan_usbpro_build(msg, PCAN_USBPRO_SETDEVID, ids, mask, n);
+	
+	return pcan_bulk(ctx, ctx->pcan_type->proto->ep_cmd_out, msg, len, &transferred);
+}
+
+static int pcan_usbpro_get_serial(struct pcan_ctx *ctx, uint32_t *serial_nr)
+{
+	unsigned char bl_info[32];
+	int r;
+	
+	/* the low word of the serial number follows ctrl type, version and date */
+	r = pcan_ctrl_in(ctx, PCAN_USBPRO_REQ_INFO, PCAN_USBPRO_INFO_BL, bl_info, sizeof(bl_info));
+	if (r < 0)
+		return r;
+	if (r < 20) {
+		fprintf(stderr, "pcan_usbpro: short bootloader info (%d bytes)\n", r);
+		return LIBUSB_ERROR_IO;
+	}
+	
+	*serial_nr = pcan_get_le32(&bl_info[16]);
+	
+	return 0;
+}
+
+static const struct pcan_proto pcan_usbpro_proto = {
+	.name = "pcan_usbpro",
+	.ep_cmd_out = PCAN_USBPRO_EP_CMDOUT,
+	.ep_cmd_in = PCAN_USBPRO_EP_CMDIN,
+	.cmd_len = PCAN_USBPRO_CMD_LEN,
+	.get_device_ids = pcan_usbpro_get_device_ids,
+	.set_device_ids = pcan_usbpro_set_device_ids,
+	.get_serial = pcan_usbpro_get_serial,
+	.xfers_get_device_ids = 2,
+	.xfers_set_device_ids = 1,
+	.xfers_get_serial = 1,
+};
+
+
+/*
+ * PCAN-USB FD family (FD, Pro FD, Chip, X6)
+ *
+ * The device ids of all channels and the serial number are part of the
+ * firmware info block. Commands are 8 byte records whose first le16 holds
+ * the channel in the upper four bits and the opcode in the lower ten. A
+ * list that does not fill the packet ends with an all 0xff record.
+ */
+
+static int pcan_usbfd_get_fw_info(struct pcan_ctx *ctx, unsigned char *fw_info)
+{
+	int r;
+	
+	r = pcan_ctrl_in(ctx, PCAN_USBPRO_REQ_INFO, PCAN_USBPRO_INFO_FW, fw_info, PCAN_UFD_FW_INFO_LEN);
+	if (r < 0)
+		return r;
+	if (r < PCAN_UFD_FW_INFO_SERIAL_OFFSET + 4) {
+		fprintf(stderr, "pcan_usbfd: short firmware info (%d bytes)\n", r);
+		return LIBUSB_ERROR_IO;
+	}
+	
+	return 0;
+}
+
+static int pcan_usbfd_get_device_ids(struct pcan_ctx *ctx, uint32_t *ids, int n)
+{
+	unsigned char fw_info[PCAN_UFD_FW_INFO_LEN];
+	int r, ch;
+	
+	r = pcan_usbfd_get_fw_info(ctx, fw_info);
+	if (r != 0)
+		return r;
+	
+	for (ch = 0; ch < n; ch++)
+		ids[ch] = pcan_get_le32(&fw_info[PCAN_UFD_FW_INFO_DEVID_OFFSET + 4 * ch]);
+	
+	return 0;
+}
+
+static int pcan_usbfd_set_device_ids(struct pcan_ctx *ctx, const uint32_t *ids, uint32_t mask, int n)
+{
+	unsigned char msg[PCAN_UFD_CMD_LEN];
+	unsigned char *rec;
+	int ch, transferred;
+	
+	memset(msg, 0, sizeof(msg));
+	
+	rec = msg;
+	for (ch = 0; ch < n; ch++) {
+		if (!(mask & (1 << ch)))
+			continue;
+		
+		pcan_put_le16(rec, (ch << 12) | (PCAN_UFD_CMD_DEVID_SET & 0x3ff));
+		pcan_put_le32(rec + 4, ids[ch]);
+		rec += PCAN_UFD_REC_LEN;
+	}
+	
+	if (rec == msg)
+		return 0;
+	
+	if (rec + PCAN_UFD_REC_LEN <= msg + sizeof(msg)) {
+		memset(rec, 0xff, PCAN_UFD_REC_LEN);
+		rec += PCAN_UFD_REC_LEN;
+	}
+	
+	return pcan_bulk(ctx, ctx->pcan_type->proto->ep_cmd_out, msg, rec - msg, &transferred);
+}
+
+static int pcan_usbfd_get_serial(struct pcan_ctx *ctx, uint32_t *serial_nr)
+{
+	unsigned char fw_info[PCAN_UFD_FW_INFO_LEN];
+	int r;
+	
+	r = pcan_usbfd_get_fw_info(ctx, fw_info);
+	if (r != 0)
+		return r;
+	
+	*serial_nr = pcan_get_le32(&fw_info[PCAN_UFD_FW_INFO_SERIAL_OFFSET]);
+	
+	return 0;
+}
+
+static const struct pcan_proto pcan_usbfd_proto = {
+	.name = "pcan_usbfd",
+	.ep_cmd_out = PCAN_UFD_EP_CMDOUT,
+	.cmd_len = PCAN_UFD_CMD_LEN,
+	.get_device_ids = pcan_usbfd_get_device_ids,
+	.set_device_ids = pcan_usbfd_set_device_ids,
+	.get_serial = pcan_usbfd_get_serial,
+	.xfers_get_device_ids = 1,
+	.xfers_set_device_ids = 1,
+	.xfers_get_serial = 1,
+};
+
+/* open ctx->device unless browse_devices() did already and prepare its pool */
+static int pcan_open_device(struct pcan_ctx *ctx)
+{
+	int r;
+	
+	if (!ctx->replay) {
+		if (!ctx->port_path[0] && pcan_port_path(ctx->device, ctx->port_path, sizeof(ctx->port_path)) < 0) {
+			fprintf(stderr, "error, cannot determine port path\n");
+			return 1;
+		}
+		ctx->bus = libusb_get_bus_number(ctx->device);
+		
+		if (!ctx->dev_handle) {
+			PCAN_PROBE1(open_start, ctx->port_path);
+			r = libusb_open(ctx->device, &ctx->dev_handle);
+			PCAN_PROBE2(open_end, ctx->port_path, r);
+			if (r < 0) {
+				fprintf(ctx->out, "error opening device: %s\n", libusb_strerror(r));
+				return 1;
+			}
+		}
+	}
+	
+	pcan_trace_device(ctx);
+	ctx->xfer_error = 0;
+	
+	if (pcan_pool_init(ctx)) {
+		fprintf(stderr, "error, out of memory\n");
+		return 1;
+	}
+	
+	return 0;
+}
+
+/* check that the job can be applied to the type of device ctx */
+static int pcan_job_has(const struct pcan_job *job, unsigned char op)
+{
+	int i;
+	
+	for (i = 0; i < job->n_ops; i++) {
+		if (job->ops[i] == op)
+			return 1;
+	}
+	
+	return 0;
+}
+
+/* append op, -i and -s run once with their last value, repeated -q once */
+static int pcan_job_add(struct pcan_job *job, unsigned char op)
+{
+	job->action = op;
+	
+	if (op != 'q' && pcan_job_has(job, op))
+		return 0;
+	if (op == 'q' && job->n_ops && job->ops[job->n_ops - 1] == 'q')
+		return 0;
+	
+	if (job->n_ops == PCAN_JOB_MAX_OPS) {
+		fprintf(stderr, "too many actions, at most %d supported\n", PCAN_JOB_MAX_OPS);
+		return 1;
+	}
+	job->ops[job->n_ops++] = op;
+	
+	return 0;
+}
+
+/* replace the operations of job by op alone */
+static void pcan_job_set(struct pcan_job *job, unsigned char op)
+{
+	job->action = op;
+	job->ops[0] = op;
+	job->n_ops = 1;
+}
+
+static int pcan_check_job(struct pcan_ctx *ctx, struct pcan_job *job)
+{
+	struct pcan_type *type = ctx->pcan_type;
+	int ch;
+	
+	if (pcan_job_has(job, 'i')) {
+		if (job->device_id_mask >> type->n_channels) {
+			fprintf(stderr, "invalid channel, %s has %u channel(s)\n",
+				   type->name, type->n_channels);
+			return 1;
+		}
+		
+		for (ch = 0; ch < type->n_channels; ch++) {
+			if ((job->device_id_mask & (1 << ch)) && job->device_ids[ch] > type->device_id_max) {
+				fprintf(stderr, "invalid device id: %u <= %u\n", job->device_ids[ch], type->device_id_max);
+				return 1;
+			}
+		}
+	}
+	
+	if (pcan_job_has(job, 's') && !type->proto->set_serial) {
+		fprintf(stderr, "setting the serial number is not supported by %s\n", type->name);
+		return 1;
+	}
+	
+	return 0;
+}
+
+/*
+ * Re-enumeration after reset
+ *
+ * If the descriptors changed across the reset (firmware that boots into a
+ * different configuration does that), the kernel re-enumerates the adapter
+ * and libusb_reset_device() returns LIBUSB_ERROR_NOT_FOUND: the handle
+ * belongs to a device that is gone. The adapter is then waited for at its
+ * port path, woken by the hotplug event of its arrival where libusb has
+ * hotplug support and by polling the device list otherwise, reopened and
+ * claimed again.
+ */
+
+struct pcan_reenum {
+	struct pcan_ctx *ctx;
+	
+	/* set once, by the hotplug callback or a poll, see pcan_reenum_found() */
+	pthread_mutex_t lock;
+	libusb_device *device;
+	int found;
+};
+
+/* returns non-zero if device is ctx's adapter back at its port, ctx->device is the old one */
+static int pcan_reenum_match(struct pcan_ctx *ctx, libusb_device *device)
+{
+	struct libusb_device_descriptor descr;
+	char port_path[PCAN_PORT_PATH_LEN];
+	
+	/* listed until libusb processes the removal, its node is dead */
+	if (device == ctx->device ||
+		(libusb_get_bus_number(device) == libusb_get_bus_number(ctx->device) &&
+		 libusb_get_device_address(device) == libusb_get_device_address(ctx->device)))
+		return 0;
+	
+	if (pcan_port_path(device, port_path, sizeof(port_path)) < 0 || strcmp(port_path, ctx->port_path))
+		return 0;
+	
+	if (libusb_get_device_descriptor(device, &descr) < 0)
+		return 0;
+	
+	return descr.idVendor == ctx->pcan_type->vendor_id && descr.idProduct == ctx->pcan_type->product_id;
+}
+
+/* take device for reenum unless the other side was first */
+static void pcan_reenum_found(struct pcan_reenum *reenum, libusb_device *device)
+{
+	pthread_mutex_lock(&reenum->lock);
+	if (!reenum->device)
+		reenum->device = libusb_ref_device(device);
+	__atomic_store_n(&reenum->found, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&reenum->lock);
+}
+
+static int LIBUSB_CALL pcan_reenum_hotplug_cb(libusb_context *usb_ctx, libusb_device *device, libusb_hotplug_event event, void *user_data)
+{
+	struct pcan_reenum *reenum = user_data;
+	
+	(void) usb_ctx;
+	(void) event;
+	if (__atomic_load_n(&reenum->found, __ATOMIC_ACQUIRE) || !pcan_reenum_match(reenum->ctx, device))
+		return 0;
+	
+	pcan_reenum_found(reenum, device);
+	
+	/* deregister */
+	return 1;
+}
+
+static void pcan_reenum_poll(struct pcan_reenum *reenum)
+{
+	libusb_device **devices;
+	ssize_t cnt, i;
+	
+	cnt = libusb_get_device_list(reenum->ctx->usb_ctx, &devices);
+	for (i = 0; i < cnt; i++) {
+		if (pcan_reenum_match(reenum->ctx, devices[i])) {
+			pcan_reenum_found(reenum, devices[i]);
+			break;
+		}
+	}
+	if (cnt >= 0)
+		libusb_free_device_list(devices, 1);
+}
+
+/*
+ * Wait for ctx's adapter to show up at its port path, returns a reference on
+ * it. ctx->device must still hold the old device, see pcan_reenum_match().
+ */
+static libusb_device *pcan_reenum_wait(struct pcan_ctx *ctx)
+{
+	libusb_hotplug_callback_handle hotplug;
+	struct pcan_reenum reenum;
+	struct timeval tv;
+	uint64_t deadline_us;
+	int has_hotplug;
+	
+	if (!pcan_has_port_path(ctx)) {
+		fprintf(stderr, "error, %s has no port path and cannot be found again after it re-enumerated\n", ctx->port_path);
+		return 0;
+	}
+	
+	memset(&reenum, 0, sizeof(reenum));
+	reenum.ctx = ctx;
+	pthread_mutex_init(&reenum.lock, 0);
+	has_hotplug = libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+		libusb_hotplug_register_callback(ctx->usb_ctx,
+					LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+					LIBUSB_HOTPLUG_NO_FLAGS,
+					ctx->pcan_type->vendor_id,
+					ctx->pcan_type->product_id,
+					LIBUSB_HOTPLUG_MATCH_ANY,
+					pcan_reenum_hotplug_cb,
+					&reenum,
+					&hotplug) == LIBUSB_SUCCESS;
+	
+	/* it may have arrived before the callback was registered */
+	pcan_reenum_poll(&reenum);
+	
+	deadline_us = pcan_now_us() + PCAN_REENUM_TIMEOUT_MS * 1000ull;
+	while (!__atomic_load_n(&reenum.found, __ATOMIC_ACQUIRE) && !pcan_cancel_signal && pcan_now_us() < deadline_us) {
+		tv.tv_sec = 0;
+		tv.tv_usec = PCAN_REENUM_POLL_MS * 1000;
+		libusb_handle_events_timeout_completed(ctx->usb_ctx, &tv, &reenum.found);
+		
+		if (!has_hotplug)
+			pcan_reenum_poll(&reenum);
+	}
+	
+	if (has_hotplug)
+		libusb_hotplug_deregister_callback(ctx->usb_ctx, hotplug);
+	pthread_mutex_destroy(&reenum.lock);
+	
+	if (!__atomic_load_n(&reenum.found, __ATOMIC_ACQUIRE)) {
+		fprintf(stderr, "error, %s did not come back within %d ms\n", ctx->port_path, PCAN_REENUM_TIMEOUT_MS);
+		return 0;
+	}
+	
+	return reenum.device;
+}
+
+/* wait for ctx's adapter to come back after a reset and reopen it */
+static int pcan_reenumerate(struct pcan_ctx *ctx)
+{
+	libusb_device *old;
+	int r;
+	
+	if (ctx->replay)
+		return 0;
+	
+	/* the handle died with the old device, so did the claim */
+	libusb_close(ctx->dev_handle);
+	ctx->dev_handle = 0;
+	ctx->claimed = 0;
+	ctx->detached = 0;
+	
+	old = ctx->device;
+	ctx->device = pcan_reenum_wait(ctx);
+	libusb_unref_device(old);
+	if (!ctx->device)
+		return LIBUSB_ERROR_NOT_FOUND;
+	
+	ctx->bus = libusb_get_bus_number(ctx->device);
+	r = libusb_open(ctx->device, &ctx->dev_handle);
+	if (r < 0) {
+		fprintf(stderr, "error reopening %s after reset: %s\n", ctx->port_path, libusb_strerror(r));
+		ctx->dev_handle = 0;
+		return r;
+	}
+	
+	return pcan_claim_device(ctx);
+}
+
+static void pcan_fleet_reset_enter(struct pcan_fleet *fleet, int hub_idx);
+static size_t pcan_hub_path_len(const char *port_path);
+static void pcan_fleet_reset_leave(struct pcan_fleet *fleet, int hub_idx);
+
+/*
+ * Hub port power cycling
+ *
+ * An adapter that stopped answering is switched off and on at its hub port
+ * with the hub class requests CLEAR_FEATURE and SET_FEATURE(PORT_POWER).
+ * This only works on hubs that switch the power of each port individually,
+ * which the hub descriptor tells. The adapter must be closed, and it is found
+ * again by its port path once it has re-enumerated.
+ */
+
+#define PCAN_HUB_PORT_POWER 8
+#define PCAN_HUB_CHAR_LPSM 0x0003
+#define PCAN_HUB_CHAR_INDV_PORT_LPSM 0x0001
+#define PCAN_HUB_POWER_OFF_MS 1000
+
+/* opt-in by --power-cycle, for all adapters of the run */
+static uint8_t pcan_power_cycle_enabled;
+
+static int pcan_hub_port_power(libusb_device_handle *hub, int port, int on)
+{
+	return libusb_control_transfer(hub, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_OTHER,
+							 on ? LIBUSB_REQUEST_SET_FEATURE : LIBUSB_REQUEST_CLEAR_FEATURE,
+							 PCAN_HUB_PORT_POWER, port, 0, 0, USB_TIMEOUT_MS);
+}
+
+/*
+ * Hub in front of ctx from its port path, with a reference, for an adapter
+ * wrapped by pcan_uevent_attach() of which libusb knows no parent.
+ */
+static libusb_device *pcan_hub_by_path(struct pcan_ctx *ctx, int *port)
+{
+	char hub_path[PCAN_PORT_PATH_LEN], path[PCAN_PORT_PATH_LEN];
+	libusb_device **devices, *hub;
+	ssize_t cnt, i;
+	size_t len;
+	
+	len = pcan_hub_path_len(ctx->port_path);
+	if (len >= strlen(ctx->port_path))
+		return 0;
+	memcpy(hub_path, ctx->port_path, len);
+	hub_path[len] = 0;
+	*port = atoi(ctx->port_path + len + 1);
+	
+	hub = 0;
+	cnt = libusb_get_device_list(ctx->usb_ctx, &devices);
+	for (i = 0; i < cnt && !hub; i++) {
+		if (pcan_port_path(devices[i], path, sizeof(path)) == 0 && !strcmp(path, hub_path))
+			hub = libusb_ref_device(devices[i]);
+	}
+	if (cnt >= 0)
+		libusb_free_device_list(devices, 1);
+	
+	return hub;
+}
+
+static int pcan_hub_power_cycle(struct pcan_ctx *ctx)
+{
+	struct timespec off = { PCAN_HUB_POWER_OFF_MS / 1000, (PCAN_HUB_POWER_OFF_MS % 1000) * 1000000L };
+	libusb_device_handle *hub;
+	libusb_device *hub_dev, *old;
+	unsigned char descr[16];
+	uint8_t descr_type;
+	int port, r;
+	
+	if (!ctx->device)
+		return LIBUSB_ERROR_NO_DEVICE;
+	
+	if (!pcan_has_port_path(ctx)) {
+		fprintf(stderr, "error, %s has no port path, its hub port is unknown\n", ctx->port_path);
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+	
+	hub_dev = libusb_get_parent(ctx->device);
+	port = libusb_get_port_number(ctx->device);
+	if (hub_dev)
+		libusb_ref_device(hub_dev);
+	else
+		hub_dev = pcan_hub_by_path(ctx, &port);
+	if (!hub_dev || !port) {
+		fprintf(stderr, "error, %s has no hub port to power cycle\n", ctx->port_path);
+		if (hub_dev)
+			libusb_unref_device(hub_dev);
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+	
+	r = libusb_open(hub_dev, &hub);
+	descr_type = libusb_get_device_speed(hub_dev) >= LIBUSB_SPEED_SUPER ? LIBUSB_DT_SUPERSPEED_HUB : LIBUSB_DT_HUB;
+	libusb_unref_device(hub_dev);
+	if (r < 0) {
+		fprintf(stderr, "error opening the hub of %s: %s\n", ctx->port_path, libusb_strerror(r));
+		return r;
+	}
+	
+	r = libusb_control_transfer(hub, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_DEVICE,
+						   LIBUSB_REQUEST_GET_DESCRIPTOR, descr_type << 8, 0, descr, sizeof(descr), USB_TIMEOUT_MS);
+	if (r < 5 || ((descr[3] | descr[4] << 8) & PCAN_HUB_CHAR_LPSM) != PCAN_HUB_CHAR_INDV_PORT_LPSM) {
+		fprintf(stderr, "error, the hub of %s cannot switch port power individually\n", ctx->port_path);
+		libusb_close(hub);
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+	
+	fprintf(stderr, "%s: power cycling hub port %d\n", ctx->port_path, port);
+	
+	/* the adapter goes away with the power, its port stays locked */
+	pcan_close_handle(ctx);
+	
+	r = pcan_hub_port_power(hub, port, 0);
+	if (r == 0) {
+		nanosleep(&off, 0);
+		r = pcan_hub_port_power(hub, port, 1);
+	}
+	libusb_close(hub);
+	if (r < 0) {
+		fprintf(stderr, "error switching port power of %s: %s\n", ctx->port_path, libusb_strerror(r));
+		return r;
+	}
+	
+	old = ctx->device;
+	ctx->device = pcan_reenum_wait(ctx);
+	libusb_unref_device(old);
+	
+	return ctx->device ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+/*
+ * Recover ctx if its last failure looks like a wedged adapter and
+ * --power-cycle is given. ctx is closed afterwards but keeps its lock until
+ * pcan_close_device(), returns 0 if it should be opened and tried again.
+ */
+static int pcan_recover_device(struct pcan_ctx *ctx)
+{
+	uint64_t start_us;
+	int r;
+	
+	if (!pcan_power_cycle_enabled || pcan_cancel_signal)
+		return 1;
+	
+	switch (ctx->xfer_error) {
+		case LIBUSB_ERROR_TIMEOUT:
+		case LIBUSB_ERROR_IO:
+		case LIBUSB_ERROR_PIPE:
+		case LIBUSB_ERROR_NO_DEVICE:
+		case LIBUSB_ERROR_NOT_FOUND:
+			break;
+		default:
+			return 1;
+	}
+	
+	/* takes a reset slot of the hub like any other reset */
+	if (ctx->fleet)
+		pcan_fleet_reset_enter(ctx->fleet, ctx->hub_idx);
+	
+	start_us = pcan_now_us();
+	if (ctx->replay) {
+		pcan_close_handle(ctx);
+		r = pcan_replay_event(ctx, PCAN_TRACE_POWER_CYCLE);
+	} else {
+		r = pcan_hub_power_cycle(ctx);
+	}
+	pcan_trace_event(ctx, PCAN_TRACE_POWER_CYCLE, r, start_us);
+	pcan_close_handle(ctx);
+	ctx->xfer_error = 0;
+	
+	if (ctx->fleet)
+		pcan_fleet_reset_leave(ctx->fleet, ctx->hub_idx);
+	
+	if (r == 0)
+		pcan_stats_retry();
+	
+	return r != 0;
+}
+
+static int pcan_reset_device(struct pcan_ctx *ctx)
+{
+	uint64_t start_us;
+	int r;
+	
+	if (ctx->fleet)
+		pcan_fleet_reset_enter(ctx->fleet, ctx->hub_idx);
+	
+	PCAN_PROBE1(reset_start, ctx->port_path);
+	start_us = pcan_now_us();
+	if (ctx->replay)
+		r = pcan_replay_event(ctx, PCAN_TRACE_RESET);
+	else
+		r = libusb_reset_device(ctx->dev_handle);
+	pcan_trace_event(ctx, PCAN_TRACE_RESET, r, start_us);
+	if (r == LIBUSB_ERROR_NOT_FOUND)
+		r = pcan_reenumerate(ctx);
+	PCAN_PROBE2(reset_end, ctx->port_path, r);
+	pcan_stats_reset();
+	
+	if (ctx->fleet)
+		pcan_fleet_reset_leave(ctx->fleet, ctx->hub_idx);
+	
+	return r;
+}
+
+/* read the ids and the serial number of the claimed device ctx into ctx */
+static int pcan_read_identity(struct pcan_ctx *ctx)
+{
+	const struct pcan_proto *proto = ctx->pcan_type->proto;
+	uint32_t device_ids[PCAN_MAX_CHANNELS];
+	uint32_t serial_nr;
+	int r;
+	
+	r = proto->get_device_ids(ctx, device_ids, ctx->pcan_type->n_channels);
+	if (r == 0) {
+		memcpy(ctx->device_ids, device_ids, sizeof(device_ids));
+		ctx->ident_valid |= PCAN_IDENT_DEVICE_IDS;
+	}
+	
+	if (proto->get_serial(ctx, &serial_nr) == 0) {
+		ctx->serial_nr = serial_nr;
+		ctx->ident_valid |= PCAN_IDENT_SERIAL;
+	} else {
+		r = 1;
+	}
+	
+	return r != 0;
+}
+
+/* lock, check job against and claim the opened device ctx, without a reset */
+static int pcan_claim_job(struct pcan_ctx *ctx, struct pcan_job *job)
+{
+	if (pcan_lock_device(ctx, job->lock_mode, job->lock_timeout_ms))
+		return 1;
+	
+	if (pcan_check_job(ctx, job))
+		return 1;
+	
+	return pcan_claim_device(ctx) != 0;
+}
+
+/* reset the device ctx claimed by pcan_claim_job() */
+static int pcan_reset_claimed(struct pcan_ctx *ctx)
+{
+	int r;
+	
+	/* other reset errors leave the adapter claimed and usable */
+	if (pcan_reset_device(ctx) != 0 && !ctx->claimed && !ctx->replay)
+		return 1;
+	
+	if (ctx->replay)
+		return 0;
+	
+	r = libusb_get_device_descriptor(ctx->device, &ctx->dev_descr);
+	if (r < 0) {
+		fprintf(stderr, "failed to get device descriptor: %s", libusb_strerror(r));
+		return 1;
+	}
+	
+	return 0;
+}
+
+/* lock, check job against, claim and reset the opened device ctx */
+static int pcan_prepare_device(struct pcan_ctx *ctx, struct pcan_job *job)
+{
+	if (pcan_claim_job(ctx, job))
+		return 1;
+	
+	return pcan_reset_claimed(ctx);
+}
+
+static void pcan_print_query(struct pcan_ctx *ctx)
+{
+	int ch;
+	
+	if (ctx->ident_valid & PCAN_IDENT_DEVICE_IDS) {
+		if (ctx->pcan_type->n_channels == 1) {
+			fprintf(ctx->out, "%20s: 0x%x\n", "device_id", ctx->device_ids[0]);
+		} else {
+			for (ch = 0; ch < ctx->pcan_type->n_channels; ch++)
+				fprintf(ctx->out, "%17s[%d]: 0x%x\n", "device_id", ch, ctx->device_ids[ch]);
+		}
+	}
+	
+	if (ctx->ident_valid & PCAN_IDENT_SERIAL)
+		fprintf(ctx->out, "%20s: 0x%x\n", "serial_number", ctx->serial_nr);
+}
+
+/* print "name[ch]: old -> new", ch < 0 for single values, old only if known */
+static void pcan_print_change(FILE *out, const char *name, int ch, int known, uint32_t old_value, uint32_t new_value)
+{
+	char old[16];
+	
+	if (known)
+		snprintf(old, sizeof(old), "0x%x", old_value);
+	else
+		snprintf(old, sizeof(old), "unknown");
+	
+	if (ch < 0)
+		fprintf(out, "%20s: %s -> 0x%x\n", name, old, new_value);
+	else
+		fprintf(out, "%17s[%d]: %s -> 0x%x\n", name, ch, old, new_value);
+}
+
+/*
+ * Dry run
+ *
+ * Current identities come from an earlier read of the same run, from sysfs
+ * while peak_usb is bound or from a read-only query that claims but never
+ * resets the adapter. Writes are only printed along with the USB operations
+ * they would cost. Transfer times are taken from the transfers made so far
+ * and fall back to PCAN_EST_XFER_US.
+ */
+
+struct pcan_plan {
+	pthread_mutex_t lock;
+	int adapters;
+	int detaches;
+	int xfers;
+	uint64_t total_us;
+	uint64_t max_us;
+};
+
+static struct pcan_plan pcan_plan = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static int pcan_query_identity(struct pcan_ctx *ctx);
+
+static uint64_t pcan_plan_xfer_us(void)
+{
+	struct pcan_stats_slot sum;
+	
+	pcan_stats_sum(&sum);
+	
+	return sum.transfers ? sum.latency_sum_us / sum.transfers : PCAN_EST_XFER_US;
+}
+
+/*
+ * Print and account the operations for writing the channels in mask and, if
+ * set_serial, the serial number of ctx, followed by identity reads.
+ */
+static void pcan_plan_write(struct pcan_ctx *ctx, uint32_t mask, int set_serial, int reads)
+{
+	const struct pcan_proto *proto = ctx->pcan_type->proto;
+	int detach, xfers;
+	uint64_t us;
+	
+	detach = !ctx->replay && libusb_kernel_driver_active(ctx->dev_handle, 0) == 1;
+	
+	xfers = reads * (proto->xfers_get_device_ids + proto->xfers_get_serial);
+	if (mask)
+		xfers += proto->xfers_set_device_ids;
+	if (set_serial)
+		xfers += proto->xfers_set_serial;
+	
+	us = PCAN_EST_RESET_US + xfers * pcan_plan_xfer_us();
+	if (detach)
+		us += 2 * PCAN_EST_DETACH_US;
+	
+	fprintf(ctx->out, "%20s: %sclaim, reset, %d transfer(s)%s, ~%llu ms\n", "plan",
+		   detach ? "detach, " : "", xfers, detach ? ", reattach" : "", (unsigned long long) us / 1000);
+	
+	pthread_mutex_lock(&pcan_plan.lock);
+	pcan_plan.adapters++;
+	pcan_plan.detaches += detach;
+	pcan_plan.xfers += xfers;
+	pcan_plan.total_us += us;
+	if (us > pcan_plan.max_us)
+		pcan_plan.max_us = us;
+	pthread_mutex_unlock(&pcan_plan.lock);
+}
+
+/* fill in the identity of ctx without side effects unless it is known already */
+static void pcan_plan_identity(struct pcan_ctx *ctx)
+{
+	if (!(ctx->ident_valid & (PCAN_IDENT_DEVICE_IDS | PCAN_IDENT_SERIAL)))
+		pcan_query_identity(ctx);
+}
+
+/* pcan_run_job() for --dry-run */
+static int pcan_plan_job(struct pcan_ctx *ctx, struct pcan_job *job)
+{
+	uint32_t mask;
+	int i, ch, known, set_serial, reads;
+	
+	if (pcan_check_job(ctx, job))
+		return 1;
+	
+	pcan_plan_identity(ctx);
+	
+	mask = 0;
+	set_serial = 0;
+	reads = 0;
+	for (i = 0; i < job->n_ops; i++) {
+		switch (job->ops[i]) {
+			case 'i':
+				known = ctx->ident_valid & PCAN_IDENT_DEVICE_IDS;
+				for (ch = 0; ch < ctx->pcan_type->n_channels; ch++) {
+					if (!(job->device_id_mask & (1 << ch)))
+						continue;
+					if (known && ctx->device_ids[ch] == job->device_ids[ch])
+						continue;
+					
+					mask |= 1 << ch;
+					pcan_print_change(ctx->out, "device_id", ctx->pcan_type->n_channels == 1 ? -1 : ch,
+							  known, ctx->device_ids[ch], job->device_ids[ch]);
+				}
+				break;
+			case 's':
+				known = ctx->ident_valid & PCAN_IDENT_SERIAL;
+				set_serial = !known || ctx->serial_nr != job->serial_nr;
+				if (set_serial)
+					pcan_print_change(ctx->out, "serial_number", -1, known, ctx->serial_nr, job->serial_nr);
+				break;
+			case 'q':
+				/* a query after a write reads back the new values */
+				if (mask || set_serial)
+					reads++;
+				else
+					pcan_print_query(ctx);
+				break;
+		}
+	}
+	
+	if (!pcan_job_has(job, 'i') && !pcan_job_has(job, 's'))
+		return !(ctx->ident_valid & PCAN_IDENT_DEVICE_IDS);
+	
+	if (!mask && !set_serial) {
+		fprintf(ctx->out, "%20s: in sync, nothing to write\n", "plan");
+		return 0;
+	}
+	
+	pcan_plan_write(ctx, mask, set_serial, reads);
+	
+	return 0;
+}
+
+static void pcan_plan_summary(int jobs)
+{
+	uint64_t us;
+	
+	if (pcan_plan.adapters == 0) {
+		printf("dry run: nothing to write\n");
+		return;
+	}
+	
+	if (jobs > pcan_plan.adapters)
+		jobs = pcan_plan.adapters;
+	us = pcan_plan.total_us / (jobs > 0 ? jobs : 1);
+	if (us < pcan_plan.max_us)
+		us = pcan_plan.max_us;
+	
+	printf("dry run: %d adapter(s) to write, %d reset(s), %d detach(es), %d USB transfer(s), ~%llu ms\n",
+		   pcan_plan.adapters, pcan_plan.adapters, pcan_plan.detaches, pcan_plan.xfers, (unsigned long long) us / 1000);
+}
+
+/* read the manufacturer and product strings of the opened device ctx */
+static void pcan_read_strings(struct pcan_ctx *ctx)
+{
+	ctx->manufacturer[0] = 0;
+	ctx->product[0] = 0;
+	if (ctx->dev_descr.iManufacturer &&
+		libusb_get_string_descriptor_ascii(ctx->dev_handle, ctx->dev_descr.iManufacturer,
+										   (unsigned char *) ctx->manufacturer, sizeof(ctx->manufacturer)) < 0)
+		ctx->manufacturer[0] = 0;
+	if (ctx->dev_descr.iProduct &&
+		libusb_get_string_descriptor_ascii(ctx->dev_handle, ctx->dev_descr.iProduct,
+										   (unsigned char *) ctx->product, sizeof(ctx->product)) < 0)
+		ctx->product[0] = 0;
+}
+
+/* the header of a job's output */
+static void pcan_print_strings(struct pcan_ctx *ctx)
+{
+	if (ctx->manufacturer[0])
+		fprintf(ctx->out, "%20s: %s\n", "iManufacturer", ctx->manufacturer);
+	if (ctx->product[0])
+		fprintf(ctx->out, "%20s: %s\n", "iProduct", ctx->product);
+	fprintf(ctx->out, "\n");
+}
+
+/* prepare the opened device ctx, then execute job on it */
+static int pcan_run_job(struct pcan_ctx *ctx, struct pcan_job *job)
+{
+	const struct pcan_proto *proto = ctx->pcan_type->proto;
+	int r, i;
+	
+	if (job->dry_run)
+		return pcan_plan_job(ctx, job);
+	
+	if (pcan_prepare_device(ctx, job))
+		return 1;
+	
+	if (ctx->replay)
+		goto actions;
+	
+	r = libusb_get_config_descriptor(ctx->device, 0, &ctx->config_descr);
+	if (r != 0) {
+		fprintf(stderr, "error, get_config_descriptor failed\n");
+		return 1;
+	}
+	
+	pcan_read_strings(ctx);
+	pcan_print_strings(ctx);
+	
+actions:
+	r = 0;
+	for (i = 0; i < job->n_ops && r == 0; i++) {
+		switch (job->ops[i]) {
+			case 'i':
+				r = proto->set_device_ids(ctx, job->device_ids, job->device_id_mask, ctx->pcan_type->n_channels);
+				break;
+			case 's':
+				r = proto->set_serial(ctx, job->serial_nr);
+				break;
+			case 'q':
+				r = pcan_read_identity(ctx);
+				pcan_print_query(ctx);
+				break;
+		}
+	}
+	
+	return r != 0;
+}
+
+
+/*
+ * Fleet operations
+ *
+ * Every supported adapter is handled by one of a few worker threads. The next
+ * device is picked so that in-flight operations spread over the root buses,
+ * devices behind idle hubs are preferred and no more than hub_resets devices
+ * behind the same hub are reset at a time, which would otherwise cause
+ * enumeration storms and transfer timeouts.
+ */
+
+enum pcan_fleet_state {
+	PCAN_FLEET_PENDING,
+	PCAN_FLEET_RUNNING,
+	PCAN_FLEET_DONE,
+};
+
+typedef int (*pcan_fleet_fn)(struct pcan_ctx *ctx, void *arg);
+
+struct pcan_fleet {
+	struct pcan_ctx **devs;
+	uint8_t *state;
+	int n;
+	
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	
+	int bus_active[256];
+	int *hub_active;
+	int *hub_resets;
+	int hub_resets_max;
+	
+	pcan_fleet_fn fn;
+	void *arg;
+	int failed;
+};
+
+/* parent hub of a port path: "1-2.3" -> "1-2", "1-2" -> "1" */
+static size_t pcan_hub_path_len(const char *port_path)
+{
+	const char *p;
+	
+	p = strrchr(port_path, '.');
+	if (!p)
+		p = strchr(port_path, '-');
+	
+	return p ? (size_t) (p - port_path) : strlen(port_path);
+}
+
+/* devices on the same hub as one of devs[0..n-1] share its hub index */
+static void pcan_fleet_assign_hub(struct pcan_ctx **devs, int n, struct pcan_ctx *dev)
+{
+	size_t hub_len;
+	int i;
+	
+	hub_len = pcan_hub_path_len(dev->port_path);
+	dev->hub_idx = n;
+	for (i = 0; i < n; i++) {
+		if (pcan_hub_path_len(devs[i]->port_path) == hub_len &&
+			!strncmp(devs[i]->port_path, dev->port_path, hub_len))
+		{
+			dev->hub_idx = devs[i]->hub_idx;
+			break;
+		}
+	}
+}
+
+/* pcan_fleet_enumerate() on the devices of the trace */
+static int pcan_replay_enumerate(struct libusb_context *usb_ctx, struct pcan_ctx ***devs_out)
+{
+	struct pcan_ctx **devs, *dev;
+	struct pcan_trace_rec *rec;
+	int i, n;
+	
+	for (n = 0; pcan_replay_device(n); n++)
+		;
+	
+	devs = calloc(n + 1, sizeof(*devs));
+	if (!devs)
+		return -1;
+	
+	n = 0;
+	for (i = 0; (rec = pcan_replay_device(i)); i++) {
+		dev = calloc(1, sizeof(*dev));
+		if (!dev)
+			break;
+		
+		dev->usb_ctx = usb_ctx;
+		dev->lock_fd = -1;
+		dev->out = stdout;
+		if (pcan_replay_attach(dev, rec)) {
+			free(dev);
+			continue;
+		}
+		
+		pcan_fleet_assign_hub(devs, n, dev);
+		devs[n++] = dev;
+	}
+	
+	*devs_out = devs;
+	
+	return n;
+}
+
+/*
+ * Collect all supported devices. Each entry holds a reference on its
+ * libusb_device and is released with pcan_fleet_free().
+ */
+static int pcan_fleet_enumerate(struct libusb_context *usb_ctx, struct pcan_ctx ***devs_out)
+{
+	struct libusb_device_descriptor descr;
+	struct pcan_ctx **devs, *dev;
+	libusb_device **devices;
+	struct pcan_type *type;
+	ssize_t cnt;
+	int c, n;
+	
+	if (pcan_replaying())
+		return pcan_replay_enumerate(usb_ctx, devs_out);
+	
+	PCAN_PROBE0(enumerate_start);
+	cnt = libusb_get_device_list(usb_ctx, &devices);
+	PCAN_PROBE1(enumerate_end, cnt);
+	if (cnt < 0) {
+		fprintf(stderr, "error retrieving list of devices: %s\n", libusb_strerror(cnt));
+		return -1;
+	}
+	
+	devs = calloc(cnt + 1, sizeof(*devs));
+	if (!devs) {
+		libusb_free_device_list(devices, 1);
+		return -1;
+	}
+	
+	n = 0;
+	for (c = 0; c < cnt; c++) {
+		if (libusb_get_device_descriptor(devices[c], &descr) < 0)
+			continue;
+		
+		type = pcan_lookup_type(descr.idVendor, descr.idProduct);
+		if (!type)
+			continue;
+		
+		dev = calloc(1, sizeof(*dev));
+		if (!dev)
+			break;
+		
+		dev->usb_ctx = usb_ctx;
+		dev->device = libusb_ref_device(devices[c]);
+		dev->dev_descr = descr;
+		dev->pcan_type = type;
+		dev->lock_fd = -1;
+		dev->out = stdout;
+		dev->bus = libusb_get_bus_number(devices[c]);
+		if (pcan_port_path(devices[c], dev->port_path, sizeof(dev->port_path)) < 0)
+			snprintf(dev->port_path, sizeof(dev->port_path), "%u", dev->bus);
+		
+		pcan_fleet_assign_hub(devs, n, dev);
+		devs[n++] = dev;
+	}
+	libusb_free_device_list(devices, 1);
+	
+	*devs_out = devs;
+	
+	return n;
+}
+
+/* entries may be 0, see struct pcan_batch */
+static void pcan_fleet_free(struct pcan_ctx **devs, int n)
+{
+	int i;
+	
+	for (i = 0; i < n; i++) {
+		if (!devs[i])
+			continue;
+		pcan_release_device(devs[i]);
+		free(devs[i]);
+	}
+	free(devs);
+}
+
+static void pcan_fleet_reset_enter(struct pcan_fleet *fleet, int hub_idx)
+{
+	pthread_mutex_lock(&fleet->lock);
+	while (fleet->hub_resets[hub_idx] >= fleet->hub_resets_max)
+		pthread_cond_wait(&fleet->cond, &fleet->lock);
+	fleet->hub_resets[hub_idx]++;
+	pthread_mutex_unlock(&fleet->lock);
+}
+
+static void pcan_fleet_reset_leave(struct pcan_fleet *fleet, int hub_idx)
+{
+	pthread_mutex_lock(&fleet->lock);
+	fleet->hub_resets[hub_idx]--;
+	pthread_cond_broadcast(&fleet->cond);
+	pthread_mutex_unlock(&fleet->lock);
+}
+
+/*
+ * Pick the pending device with the least busy root bus, then the least busy
+ * hub, preferring hubs that have a free reset slot. Called with the lock held.
+ */
+static int pcan_fleet_pick(struct pcan_fleet *fleet)
+{
+	struct pcan_ctx *dev;
+	int i, best, full, best_full;
+	
+	best = -1;
+	best_full = 0;
+	for (i = 0; i < fleet->n; i++) {
+		if (fleet->state[i] != PCAN_FLEET_PENDING)
+			continue;
+		
+		dev = fleet->devs[i];
+		full = fleet->hub_resets[dev->hub_idx] >= fleet->hub_resets_max;
+		if (best >= 0) {
+			struct pcan_ctx *b = fleet->devs[best];
+			
+			if (full != best_full) {
+				if (full)
+					continue;
+			} else if (fleet->bus_active[dev->bus] != fleet->bus_active[b->bus]) {
+				if (fleet->bus_active[dev->bus] > fleet->bus_active[b->bus])
+					continue;
+			} else if (fleet->hub_active[dev->hub_idx] >= fleet->hub_active[b->hub_idx]) {
+				continue;
+			}
+		}
+		
+		best = i;
+		best_full = full;
+	}
+	
+	return best;
+}
+
+static void *pcan_fleet_worker(void *arg)
+{
+	struct pcan_fleet *fleet = arg;
+	struct pcan_ctx *dev;
+	char *buf;
+	size_t len;
+	int i, r;
+	
+	for (;;) {
+		pthread_mutex_lock(&fleet->lock);
+		i = pcan_cancel_signal ? -1 : pcan_fleet_pick(fleet);
+		if (i < 0) {
+			pthread_mutex_unlock(&fleet->lock);
+			break;
+		}
+		dev = fleet->devs[i];
+		fleet->state[i] = PCAN_FLEET_RUNNING;
+		fleet->bus_active[dev->bus]++;
+		fleet->hub_active[dev->hub_idx]++;
+		pthread_mutex_unlock(&fleet->lock);
+		
+		buf = 0;
+		dev->out = open_memstream(&buf, &len);
+		if (!dev->out)
+			dev->out = stdout;
+		
+		r = pcan_open_device(dev);
+		if (r == 0)
+			r = fleet->fn(dev, fleet->arg);
+		if (r && pcan_recover_device(dev) == 0 && pcan_open_device(dev) == 0)
+			r = fleet->fn(dev, fleet->arg);
+		pcan_close_device(dev);
+		
+		pthread_mutex_lock(&fleet->lock);
+		if (dev->out != stdout) {
+			fclose(dev->out);
+			printf("%s (%s):\n%s\n", dev->port_path, dev->pcan_type->name, buf ? buf : "");
+			fflush(stdout);
+		}
+		free(buf);
+		dev->out = stdout;
+		
+		if (r)
+			fleet->failed++;
+		fleet->state[i] = PCAN_FLEET_DONE;
+		fleet->bus_active[dev->bus]--;
+		fleet->hub_active[dev->hub_idx]--;
+		pthread_cond_broadcast(&fleet->cond);
+		pthread_mutex_unlock(&fleet->lock);
+	}
+	
+	return 0;
+}
+
+/* run fn on every device in devs, returns the number of failed devices */
+static int pcan_fleet_run(struct pcan_ctx **devs, int n, int jobs, int hub_resets, pcan_fleet_fn fn, void *arg)
+{
+	struct pcan_fleet fleet;
+	pthread_t *threads;
+	int i, started;
+	
+	memset(&fleet, 0, sizeof(fleet));
+	fleet.devs = devs;
+	fleet.n = n;
+	fleet.fn = fn;
+	fleet.arg = arg;
+	fleet.hub_resets_max = hub_resets > 0 ? hub_resets : 1;
+	fleet.state = calloc(n, sizeof(*fleet.state));
+	fleet.hub_active = calloc(n, sizeof(*fleet.hub_active));
+	fleet.hub_resets = calloc(n, sizeof(*fleet.hub_resets));
+	if (jobs < 1)
+		jobs = 1;
+	if (jobs > n)
+		jobs = n;
+	threads = calloc(jobs, sizeof(*threads));
+	if (!fleet.state || !fleet.hub_active || !fleet.hub_resets || !threads) {
+		fprintf(stderr, "error, out of memory\n");
+		fleet.failed = n;
+		goto out;
+	}
+	
+	pthread_mutex_init(&fleet.lock, 0);
+	pthread_cond_init(&fleet.cond, 0);
+	
+	for (i = 0; i < n; i++)
+		devs[i]->fleet = &fleet;
+	
+	started = 0;
+	for (i = 0; i < jobs; i++) {
+		if (pthread_create(&threads[i], 0, pcan_fleet_worker, &fleet) != 0)
+			break;
+		started++;
+	}
+	
+	/* run inline if no thread could be started */
+	if (started == 0)
+		pcan_fleet_worker(&fleet);
+	
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], 0);
+	
+	for (i = 0; i < n; i++) {
+		devs[i]->fleet = 0;
+		
+		/* not started because the run was cancelled */
+		if (fleet.state[i] == PCAN_FLEET_PENDING)
+			fleet.failed++;
+	}
+	
+	pthread_cond_destroy(&fleet.cond);
+	pthread_mutex_destroy(&fleet.lock);
+	
+out:
+	free(threads);
+	free(fleet.hub_resets);
+	free(fleet.hub_active);
+	free(fleet.state);
+	
+	return fleet.failed;
+}
+
+static int pcan_fleet_job(struct pcan_ctx *ctx, void *arg)
+{
+	return pcan_run_job(ctx, arg);
+}
+
+/*
+ * Identity of a device
+ *
+ * While peak_usb is bound, the kernel (6.6 and later) exports the device id of
+ * every channel as net/<netdev>/peak_usb/can_channel_id below interface 0.
+ * Reading it there leaves the CAN interfaces untouched; only devices without
+ * a bound driver are claimed and queried over USB.
+ */
+
+static int pcan_sysfs_read_u32(const char *path, uint32_t *value)
+{
+	char buf[32], *end;
+	ssize_t len;
+	int fd;
+	
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return -1;
+	buf[len] = 0;
+	
+	*value = strtoul(buf, &end, 16);
+	
+	return end == buf ? -1 : 0;
+}
+
+/*
+ * returns 0 if the ids of all channels of ctx were found in sysfs, -2 if
+ * peak_usb is bound but older than Linux 6.6 and does not export them
+ */
+static int pcan_sysfs_device_ids(struct pcan_ctx *ctx, uint32_t *ids)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	uint32_t found, ch, id;
+	DIR *dir;
+	int n, missing;
+	
+	n = ctx->pcan_type->n_channels;
+	snprintf(path, sizeof(path), "%s/%s:1.0/net", PCAN_SYSFS_USB, ctx->port_path);
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+	
+	found = 0;
+	missing = 0;
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+		
+		snprintf(path, sizeof(path), "%s/%s:1.0/net/%s/dev_id", PCAN_SYSFS_USB, ctx->port_path, de->d_name);
+		if (pcan_sysfs_read_u32(path, &ch) || ch >= (uint32_t) n)
+			continue;
+		
+		snprintf(path, sizeof(path), "%s/%s:1.0/net/%s/peak_usb/can_channel_id", PCAN_SYSFS_USB, ctx->port_path, de->d_name);
+		if (pcan_sysfs_read_u32(path, &id)) {
+			missing = 1;
+			continue;
+		}
+		
+		ids[ch] = id;
+		found |= 1 << ch;
+	}
+	closedir(dir);
+	
+	if (found == (1u << n) - 1)
+		return 0;
+	
+	return missing ? -2 : -1;
+}
+
+/* CAN interface name of every channel of ctx, empty if peak_usb is not bound */
+static void pcan_sysfs_netdevs(struct pcan_ctx *ctx, char names[][PCAN_SHM_NETDEV_LEN])
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	uint32_t ch;
+	DIR *dir;
+	
+	memset(names, 0, ctx->pcan_type->n_channels * sizeof(names[0]));
+	if (ctx->replay)
+		return;
+	
+	snprintf(path, sizeof(path), "%s/%s:1.0/net", PCAN_SYSFS_USB, ctx->port_path);
+	dir = opendir(path);
+	if (!dir)
+		return;
+	
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.')
+			continue;
+		
+		/* interface names are shorter than IFNAMSIZ */
+		if (strlen(de->d_name) >= sizeof(names[0]))
+			continue;
+		
+		snprintf(path, sizeof(path), "%s/%s:1.0/net/%s/dev_id", PCAN_SYSFS_USB, ctx->port_path, de->d_name);
+		if (pcan_sysfs_read_u32(path, &ch) || ch >= (uint32_t) ctx->pcan_type->n_channels)
+			continue;
+		
+		memcpy(names[ch], de->d_name, strlen(de->d_name) + 1);
+	}
+	closedir(dir);
+}
+
+/*
+ * Refresh ctx->device_ids and, where it can be read without disturbing the
+ * kernel driver, ctx->serial_nr. The opened device is neither reset nor kept
+ * claimed.
+ */
+static int pcan_query_identity(struct pcan_ctx *ctx)
+{
+	static int warned;
+	uint32_t ids[PCAN_MAX_CHANNELS];
+	int r;
+	
+	r = ctx->replay ? -1 : pcan_sysfs_device_ids(ctx, ids);
+	if (r == 0) {
+		memcpy(ctx->device_ids, ids, ctx->pcan_type->n_channels * sizeof(ids[0]));
+		ctx->ident_valid |= PCAN_IDENT_DEVICE_IDS;
+		return 0;
+	}
+	
+	/* the ids stay unknown, pcan_print_identity() leaves them out */
+	if (r == -2 && !__atomic_exchange_n(&warned, 1, __ATOMIC_RELAXED))
+		fprintf(stderr, "warning, peak_usb of this kernel does not export can_channel_id (Linux 6.6), "
+				"the device ids of adapters it holds are unknown\n");
+	
+	if (!ctx->replay && libusb_kernel_driver_active(ctx->dev_handle, 0) == 1)
+		return 1;
+	
+	/* somebody else is working with the device, try again next time */
+	if (pcan_lock_device(ctx, PCAN_LOCK_TRY, 0))
+		return 1;
+	
+	r = pcan_claim_device(ctx);
+	if (r == 0)
+		r = pcan_read_identity(ctx);
+	pcan_unclaim_device(ctx);
+	pcan_unlock_device(ctx);
+	
+	return r != 0;
+}
+
+static void pcan_print_identity(struct pcan_ctx *ctx, FILE *out)
+{
+	int ch;
+	
+	fprintf(out, "%s %s", ctx->port_path, ctx->pcan_type->name);
+	if (ctx->ident_valid & PCAN_IDENT_DEVICE_IDS) {
+		fprintf(out, " device_id=");
+		for (ch = 0; ch < ctx->pcan_type->n_channels; ch++)
+			fprintf(out, "%s0x%x", ch ? "," : "", ctx->device_ids[ch]);
+	}
+	if (ctx->ident_valid & PCAN_IDENT_SERIAL)
+		fprintf(out, " serial_number=0x%x", ctx->serial_nr);
+	fprintf(out, "\n");
+}
+
+/*
+ * Prometheus textfile collector output
+ *
+ * The file is written to a temporary name and renamed so that the collector
+ * never reads a partial file.
+ */
+
+static void pcan_metrics_header(FILE *f, const char *name, const char *type, const char *help)
+{
+	fprintf(f, "# HELP %s %s\n", name, help);
+	fprintf(f, "# TYPE %s %s\n", name, type);
+}
+
+static int pcan_metrics_write(const char *path, struct pcan_ctx **devs, int n)
+{
+	struct pcan_stats_slot sum;
+	char tmp[PATH_MAX];
+	uint64_t cumulative;
+	FILE *f;
+	int i, ch, b;
+	
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int) getpid());
+	f = fopen(tmp, "w");
+	if (!f) {
+		fprintf(stderr, "error, cannot write %s: %s\n", tmp, strerror(errno));
+		return 1;
+	}
+	
+	pcan_metrics_header(f, "pcan_adapter_present", "gauge", "Adapter found on the USB bus.");
+	for (i = 0; i < n; i++)
+		fprintf(f, "pcan_adapter_present{path=\"%s\",type=\"%s\"} 1\n", devs[i]->port_path, devs[i]->pcan_type->name);
+	
+	pcan_metrics_header(f, "pcan_adapter_device_id", "gauge", "Device id of an adapter channel.");
+	for (i = 0; i < n; i++) {
+		if (!(devs[i]->ident_valid & PCAN_IDENT_DEVICE_IDS))
+			continue;
+		for (ch = 0; ch < devs[i]->pcan_type->n_channels; ch++)
+			fprintf(f, "pcan_adapter_device_id{path=\"%s\",channel=\"%d\"} %u\n", devs[i]->port_path, ch, devs[i]->device_ids[ch]);
+	}
+	
+	pcan_metrics_header(f, "pcan_adapter_serial_number", "gauge", "Serial number of an adapter.");
+	for (i = 0; i < n; i++) {
+		if (devs[i]->ident_valid & PCAN_IDENT_SERIAL)
+			fprintf(f, "pcan_adapter_serial_number{path=\"%s\"} %u\n", devs[i]->port_path, devs[i]->serial_nr);
+	}
+	
+	pcan_stats_sum(&sum);
+	
+	pcan_metrics_header(f, "pcan_usb_transfers_total", "counter", "USB transfers submitted.");
+	fprintf(f, "pcan_usb_transfers_total %llu\n", (unsigned long long) sum.transfers);
+	pcan_metrics_header(f, "pcan_usb_transfer_errors_total", "counter", "USB transfers failed for other reasons than a timeout.");
+	fprintf(f, "pcan_usb_transfer_errors_total %llu\n", (unsigned long long) sum.errors);
+	pcan_metrics_header(f, "pcan_usb_transfer_timeouts_total", "counter", "USB transfers timed out.");
+	fprintf(f, "pcan_usb_transfer_timeouts_total %llu\n", (unsigned long long) sum.timeouts);
+	pcan_metrics_header(f, "pcan_usb_resets_total", "counter", "USB device resets.");
+	fprintf(f, "pcan_usb_resets_total %llu\n", (unsigned long long) sum.resets);
+	pcan_metrics_header(f, "pcan_retries_total", "counter", "Jobs retried after a power cycle.");
+	fprintf(f, "pcan_retries_total %llu\n", (unsigned long long) sum.retries);
+	
+	pcan_metrics_header(f, "pcan_usb_transfer_latency_seconds", "histogram", "Round-trip time of USB transfers.");
+	cumulative = 0;
+	for (b = 0; b < PCAN_LATENCY_BUCKETS; b++) {
+		cumulative += sum.latency_bucket[b];
+		fprintf(f, "pcan_usb_transfer_latency_seconds_bucket{le=\"%g\"} %llu\n",
+			   pcan_latency_bounds_us[b] / 1e6, (unsigned long long) cumulative);
+	}
+	cumulative += sum.latency_bucket[PCAN_LATENCY_BUCKETS];
+	fprintf(f, "pcan_usb_transfer_latency_seconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long) cumulative);
+	fprintf(f, "pcan_usb_transfer_latency_seconds_sum %g\n", sum.latency_sum_us / 1e6);
+	fprintf(f, "pcan_usb_transfer_latency_seconds_count %llu\n", (unsigned long long) cumulative);
+	
+	if (fclose(f) != 0 || rename(tmp, path) != 0) {
+		fprintf(stderr, "error, cannot write %s: %s\n", path, strerror(errno));
+		unlink(tmp);
+		return 1;
+	}
+	
+	return 0;
+}
+
+
+/*
+ * Fleet snapshots
+ *
+ * A snapshot holds the port path, USB ids, device ids and serial number of
+ * every adapter. The binary form is PCAN_SNAPSHOT_MAGIC followed by one
+ * struct pcan_snap_rec per adapter in host byte order, the readable form has
+ * one line per adapter. Restoring matches adapters by port path, so an
+ * adapter swapped in on the same port inherits the ids of its predecessor.
+ */
+
+struct pcan_snap_rec {
+	char port_path[PCAN_PORT_PATH_LEN];
+	uint16_t vendor_id;
+	uint16_t product_id;
+	uint16_t bcd_device;
+	uint8_t n_channels;
+	uint8_t ident_valid;
+	uint32_t device_ids[PCAN_MAX_CHANNELS];
+	uint32_t serial_nr;
+} __attribute__((packed));
+
+struct pcan_snapshot {
+	struct pcan_snap_rec *recs;
+	int n;
+	
+	/* lock settings for restoring */
+	struct pcan_job *job;
+	
+	/* values overwritten by pcan_restore_job() when job->atomic is set */
+	struct pcan_snap_rec *captured;
+	int n_captured;
+	int max_captured;
+	pthread_mutex_t lock;
+};
+
+static void pcan_snapshot_fill(struct pcan_snap_rec *rec, struct pcan_ctx *ctx)
+{
+	memset(rec, 0, sizeof(*rec));
+	memcpy(rec->port_path, ctx->port_path, sizeof(rec->port_path));
+	rec->vendor_id = ctx->pcan_type->vendor_id;
+	rec->product_id = ctx->pcan_type->product_id;
+	rec->bcd_device = ctx->dev_descr.bcdDevice;
+	rec->n_channels = ctx->pcan_type->n_channels;
+	rec->ident_valid = ctx->ident_valid & (PCAN_IDENT_DEVICE_IDS | PCAN_IDENT_SERIAL);
+	memcpy(rec->device_ids, ctx->device_ids, sizeof(rec->device_ids));
+	rec->serial_nr = ctx->serial_nr;
+}
+
+static void pcan_snapshot_print(struct pcan_snap_rec *rec, FILE *f)
+{
+	struct pcan_type *type = pcan_lookup_type(rec->vendor_id, rec->product_id);
+	int ch;
+	
+	fprintf(f, "%s %04x:%04x bcd_device=0x%04x", rec->port_path, rec->vendor_id, rec->product_id, rec->bcd_device);
+	if (rec->ident_valid & PCAN_IDENT_DEVICE_IDS) {
+		fprintf(f, " device_id=");
+		for (ch = 0; ch < rec->n_channels; ch++)
+			fprintf(f, "%s0x%x", ch ? "," : "", rec->device_ids[ch]);
+	}
+	if (rec->ident_valid & PCAN_IDENT_SERIAL)
+		fprintf(f, " serial_number=0x%x", rec->serial_nr);
+	fprintf(f, " # %s\n", type ? type->name : "unknown");
+}
+
+/* write the identities of devs read by a previous query, text selects the readable form */
+static int pcan_snapshot_write(const char *path, struct pcan_ctx **devs, int n, int text)
+{
+	struct pcan_snap_rec rec;
+	char tmp[PATH_MAX];
+	FILE *f;
+	int i;
+	
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int) getpid());
+	f = fopen(tmp, text ? "w" : "wb");
+	if (!f) {
+		fprintf(stderr, "error, cannot write %s: %s\n", tmp, strerror(errno));
+		return 1;
+	}
+	
+	if (text)
+		fprintf(f, "# pcan-id snapshot: path vid:pid bcd_device device_id serial_number\n");
+	else
+		fwrite(PCAN_SNAPSHOT_MAGIC, 8, 1, f);
+	
+	for (i = 0; i < n; i++) {
+		if (!(devs[i]->ident_valid & (PCAN_IDENT_DEVICE_IDS | PCAN_IDENT_SERIAL))) {
+			fprintf(stderr, "warning, %s left out of the snapshot, identity unknown\n", devs[i]->port_path);
+			continue;
+		}
+		
+		pcan_snapshot_fill(&rec, devs[i]);
+		if (text)
+			pcan_snapshot_print(&rec, f);
+		else
+			fwrite(&rec, sizeof(rec), 1, f);
+	}
+	
+	if (fclose(f) != 0 || rename(tmp, path) != 0) {
+		fprintf(stderr, "error, cannot write %s: %s\n", path, strerror(errno));
+		unlink(tmp);
+		return 1;
+	}
+	
+	return 0;
+}
+
+/* parse one line of the readable form, returns 1 for blank and comment lines */
+static int pcan_snapshot_parse(char *line, struct pcan_snap_rec *rec)
+{
+	unsigned int vendor_id, product_id;
+	char *p, *end;
+	int ch;
+	
+	memset(rec, 0, sizeof(*rec));
+	
+	p = strchr(line, '#');
+	if (p)
+		*p = 0;
+	p = line + strspn(line, " \t\r\n");
+	if (!*p)
+		return 1;
+	
+	if (sscanf(p, "%31s %x:%x", rec->port_path, &vendor_id, &product_id) != 3)
+		return -1;
+	rec->vendor_id = vendor_id;
+	rec->product_id = product_id;
+	
+	p = strstr(line, "bcd_device=");
+	if (p)
+		rec->bcd_device = strtoul(p + strlen("bcd_device="), 0, 16);
+	
+	p = strstr(line, "device_id=");
+	if (p) {
+		p += strlen("device_id=");
+		for (ch = 0; ch < PCAN_MAX_CHANNELS; ch++) {
+			rec->device_ids[ch] = strtoul(p, &end, 0);
+			if (end == p)
+				return -1;
+			rec->n_channels++;
+			if (*end != ',')
+				break;
+			p = end + 1;
+		}
+		rec->ident_valid |= PCAN_IDENT_DEVICE_IDS;
+	}
+	
+	p = strstr(line, "serial_number=");
+	if (p) {
+		p += strlen("serial_number=");
+		rec->serial_nr = strtoul(p, &end, 0);
+		if (end == p)
+			return -1;
+		rec->ident_valid |= PCAN_IDENT_SERIAL;
+	}
+	
+	return 0;
+}
+
+static int pcan_snapshot_add(struct pcan_snapshot *snap, struct pcan_snap_rec *rec)
+{
+	struct pcan_snap_rec *recs;
+	
+	recs = realloc(snap->recs, (snap->n + 1) * sizeof(*recs));
+	if (!recs) {
+		fprintf(stderr, "error, out of memory\n");
+		return 1;
+	}
+	recs[snap->n++] = *rec;
+	snap->recs = recs;
+	
+	return 0;
+}
+
+/* load a snapshot in either form */
+static int pcan_snapshot_load(const char *path, struct pcan_snapshot *snap)
+{
+	struct pcan_snap_rec rec;
+	char line[256];
+	int lineno, r;
+	FILE *f;
+	
+	memset(snap, 0, sizeof(*snap));
+	
+	f = fopen(path, "rb");
+	if (!f) {
+		fprintf(stderr, "error, cannot read %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	
+	r = 0;
+	if (fread(line, 8, 1, f) == 1 && !memcmp(line, PCAN_SNAPSHOT_MAGIC, 8)) {
+		while (r == 0 && fread(&rec, sizeof(rec), 1, f) == 1) {
+			rec.port_path[PCAN_PORT_PATH_LEN - 1] = 0;
+			if (rec.n_channels > PCAN_MAX_CHANNELS)
+				rec.n_channels = PCAN_MAX_CHANNELS;
+			r = pcan_snapshot_add(snap, &rec);
+		}
+	} else {
+		rewind(f);
+		for (lineno = 1; r == 0 && fgets(line, sizeof(line), f); lineno++) {
+			r = pcan_snapshot_parse(line, &rec);
+			if (r < 0)
+				fprintf(stderr, "error, %s:%d: invalid snapshot line\n", path, lineno);
+			else if (r == 0)
+				r = pcan_snapshot_add(snap, &rec);
+			else
+				r = 0;
+		}
+	}
+	fclose(f);
+	
+	if (r) {
+		free(snap->recs);
+		snap->recs = 0;
+		snap->n = 0;
+		return 1;
+	}
+	
+	return 0;
+}
+
+static struct pcan_snap_rec *pcan_snapshot_find(struct pcan_snapshot *snap, const char *port_path)
+{
+	int i;
+	
+	for (i = 0; i < snap->n; i++) {
+		if (!strcmp(snap->recs[i].port_path, port_path))
+			return &snap->recs[i];
+	}
+	
+	return 0;
+}
+
+/* write the ids and serial number of ctx that drifted from the snapshot and read them back */
+static int pcan_restore_job(struct pcan_ctx *ctx, void *arg)
+{
+	struct pcan_snapshot *snap = arg;
+	struct pcan_type *type = ctx->pcan_type;
+	struct pcan_snap_rec *rec;
+	struct pcan_job job;
+	int ch, known, set_serial;
+	
+	rec = pcan_snapshot_find(snap, ctx->port_path);
+	if (!rec) {
+		fprintf(ctx->out, "%20s: not in snapshot, left alone\n", "restore");
+		return 0;
+	}
+	
+	if (rec->vendor_id != type->vendor_id || rec->product_id != type->product_id) {
+		fprintf(ctx->out, "%20s: error, snapshot has a %04x:%04x adapter on this port\n",
+			   "restore", rec->vendor_id, rec->product_id);
+		return 1;
+	}
+	
+	/* adapters in sync are only read, not reset */
+	job = *snap->job;
+	pcan_job_set(&job, 'q');
+	if (job.dry_run) {
+		pcan_plan_identity(ctx);
+	} else {
+		if (pcan_claim_job(ctx, &job))
+			return 1;
+		
+		if (pcan_read_identity(ctx)) {
+			fprintf(ctx->out, "%20s: error, cannot read the current identity\n", "restore");
+			return 1;
+		}
+	}
+	
+	pcan_job_set(&job, 'i');
+	job.device_id_mask = 0;
+	if (rec->ident_valid & PCAN_IDENT_DEVICE_IDS) {
+		known = ctx->ident_valid & PCAN_IDENT_DEVICE_IDS;
+		for (ch = 0; ch < type->n_channels && ch < rec->n_channels; ch++) {
+			if (known && rec->device_ids[ch] == ctx->device_ids[ch])
+				continue;
+			
+			job.device_ids[ch] = rec->device_ids[ch];
+			job.device_id_mask |= 1 << ch;
+			pcan_print_change(ctx->out, "device_id", type->n_channels == 1 ? -1 : ch,
+					  known, ctx->device_ids[ch], rec->device_ids[ch]);
+		}
+	}
+	
+	known = ctx->ident_valid & PCAN_IDENT_SERIAL;
+	set_serial = (rec->ident_valid & PCAN_IDENT_SERIAL) && (!known || rec->serial_nr != ctx->serial_nr);
+	if (set_serial && !type->proto->set_serial) {
+		if (known)
+			fprintf(ctx->out, "%20s: 0x%x, snapshot has 0x%x (not settable)\n", "serial_number", ctx->serial_nr, rec->serial_nr);
+		set_serial = 0;
+	} else if (set_serial) {
+		pcan_print_change(ctx->out, "serial_number", -1, known, ctx->serial_nr, rec->serial_nr);
+	}
+	
+	if (!job.device_id_mask && !set_serial) {
+		fprintf(ctx->out, "%20s: in sync\n", "restore");
+		return 0;
+	}
+	
+	if (job.device_id_mask && pcan_check_job(ctx, &job))
+		return 1;
+	
+	if (job.dry_run) {
+		pcan_plan_write(ctx, job.device_id_mask, set_serial, 2);
+		return 0;
+	}
+	
+	if (pcan_reset_claimed(ctx))
+		return 1;
+	
+	if (snap->captured) {
+		struct pcan_snap_rec *cap;
+		int c;
+		
+		/* a retry after a power cycle keeps what the first attempt found */
+		pthread_mutex_lock(&snap->lock);
+		for (c = 0; c < snap->n_captured; c++) {
+			if (!strcmp(snap->captured[c].port_path, ctx->port_path))
+				break;
+		}
+		if (c == snap->n_captured) {
+			assert(snap->n_captured < snap->max_captured);
+			cap = &snap->captured[snap->n_captured++];
+			pcan_snapshot_fill(cap, ctx);
+			cap->ident_valid = (job.device_id_mask ? PCAN_IDENT_DEVICE_IDS : 0) | (set_serial ? PCAN_IDENT_SERIAL : 0);
+		}
+		pthread_mutex_unlock(&snap->lock);
+	}
+	
+	if (job.device_id_mask) {
+		if (type->proto->set_device_ids(ctx, job.device_ids, job.device_id_mask, type->n_channels)) {
+			fprintf(ctx->out, "%20s: error, setting the device id failed\n", "restore");
+			return 1;
+		}
+	}
+	
+	if (set_serial && type->proto->set_serial(ctx, rec->serial_nr)) {
+		fprintf(ctx->out, "%20s: error, setting the serial number failed\n", "restore");
+		return 1;
+	}
+	
+	/* read back what was written */
+	if (pcan_read_identity(ctx) == 0) {
+		for (ch = 0; ch < type->n_channels; ch++) {
+			if ((job.device_id_mask & (1 << ch)) && ctx->device_ids[ch] != job.device_ids[ch])
+				break;
+		}
+		
+		if (ch == type->n_channels && (!set_serial || ctx->serial_nr == rec->serial_nr)) {
+			fprintf(ctx->out, "%20s: verified\n", "restore");
+			return 0;
+		}
+	}
+	
+	fprintf(ctx->out, "%20s: error, verification failed\n", "restore");
+	
+	return 1;
+}
+
+static int pcan_restore_run(struct pcan_snapshot *snap, struct pcan_ctx **devs, int n, int jobs, int hub_resets);
+
+/* write the values captured by an atomic restore back to devs */
+static int pcan_restore_rollback(struct pcan_snapshot *snap, struct pcan_ctx **devs, int n, int jobs, int hub_resets)
+{
+	struct pcan_snapshot rollback;
+	struct pcan_ctx **written;
+	struct pcan_job job;
+	sig_atomic_t cancel_signal;
+	int failed, i, m;
+	
+	written = calloc(n + 1, sizeof(*written));
+	if (!written) {
+		fprintf(stderr, "error, out of memory, cannot roll back\n");
+		return n;
+	}
+	
+	memset(&rollback, 0, sizeof(rollback));
+	rollback.recs = snap->captured;
+	rollback.n = snap->n_captured;
+	job = *snap->job;
+	job.atomic = 0;
+	rollback.job = &job;
+	
+	m = 0;
+	for (i = 0; i < n; i++) {
+		if (pcan_snapshot_find(&rollback, devs[i]->port_path))
+			written[m++] = devs[i];
+	}
+	
+	/* the rollback has to run even if the restore was cancelled */
+	cancel_signal = pcan_cancel_signal;
+	pcan_cancel_signal = 0;
+	
+	fprintf(stderr, "rolling back %d adapter(s)\n", m);
+	printf("\n");
+	failed = pcan_restore_run(&rollback, written, m, jobs, hub_resets);
+	if (failed)
+		fprintf(stderr, "error, rollback failed on %d adapter(s)\n", failed);
+	
+	if (!pcan_cancel_signal)
+		pcan_cancel_signal = cancel_signal;
+	free(written);
+	
+	return failed;
+}
+
+/*
+ * Restore snap on devs in parallel, returns the number of failed or missing
+ * adapters. With job->atomic all adapters written so far are rolled back to
+ * their previous values if any adapter fails.
+ */
+static int pcan_restore_run(struct pcan_snapshot *snap, struct pcan_ctx **devs, int n, int jobs, int hub_resets)
+{
+	int failed, i, j;
+	
+	if (snap->job->atomic) {
+		/* one entry per adapter, see pcan_restore_job() */
+		snap->captured = calloc(n ? n : 1, sizeof(*snap->captured));
+		if (!snap->captured) {
+			fprintf(stderr, "error, out of memory\n");
+			return n;
+		}
+		snap->n_captured = 0;
+		snap->max_captured = n;
+		pthread_mutex_init(&snap->lock, 0);
+	}
+	
+	failed = pcan_fleet_run(devs, n, jobs, hub_resets, pcan_restore_job, snap);
+	
+	for (i = 0; i < snap->n; i++) {
+		for (j = 0; j < n; j++) {
+			if (!strcmp(devs[j]->port_path, snap->recs[i].port_path))
+				break;
+		}
+		
+		if (j == n) {
+			fprintf(stderr, "error, adapter %s of the snapshot not found\n", snap->recs[i].port_path);
+			failed++;
+		}
+	}
+	
+	if (snap->captured) {
+		if (failed && snap->n_captured)
+			pcan_restore_rollback(snap, devs, n, jobs, hub_resets);
+		
+		pthread_mutex_destroy(&snap->lock);
+		free(snap->captured);
+		snap->captured = 0;
+		snap->n_captured = 0;
+		snap->max_captured = 0;
+	}
+	
+	return failed;
+}
+
+
+/*
+ * Device id conflicts
+ *
+ * The channels of all adapters share one id space. Collisions are found by
+ * sorting the ids read by a fleet query. On request every channel but the
+ * first of a collision gets the lowest id not used anywhere in the fleet,
+ * taken from a bitmap of the ids up to UCHAR_MAX that all adapter types can
+ * store. The new ids are written per adapter in one exchange and read back
+ * through pcan_restore_run().
+ */
+
+#define PCAN_ID_BITMAP_WORDS ((UCHAR_MAX + 1) / 64)
+
+struct pcan_id_use {
+	uint32_t id;
+	int dev;
+	int ch;
+};
+
+static int pcan_id_use_cmp(const void *a, const void *b)
+{
+	const struct pcan_id_use *x = a, *y = b;
+	
+	if (x->id != y->id)
+		return x->id < y->id ? -1 : 1;
+	if (x->dev != y->dev)
+		return x->dev - y->dev;
+	return x->ch - y->ch;
+}
+
+/* take the lowest free id up to max from used, -1 if there is none */
+static int pcan_id_alloc(uint64_t *used, uint32_t max)
+{
+	int w, id;
+	
+	for (w = 0; w < PCAN_ID_BITMAP_WORDS; w++) {
+		if (used[w] == UINT64_MAX)
+			continue;
+		
+		id = w * 64 + __builtin_ctzll(~used[w]);
+		if ((uint32_t) id > max)
+			return -1;
+		used[w] |= 1ull << (id % 64);
+		return id;
+	}
+	
+	return -1;
+}
+
+/*
+ * Report device id collisions among devs after a query. With assign the
+ * colliding channels are given free ids. Returns non-zero if collisions
+ * remain.
+ */
+static int pcan_check_ids(struct pcan_ctx **devs, int n, int assign, struct pcan_job *job, int jobs, int hub_resets)
+{
+	uint64_t used[PCAN_ID_BITMAP_WORDS];
+	struct pcan_ctx **changed;
+	struct pcan_id_use *uses;
+	struct pcan_snapshot plan;
+	struct pcan_snap_rec *rec;
+	int i, j, k, ch, m, id, collisions, r;
+	
+	uses = calloc(n * PCAN_MAX_CHANNELS + 1, sizeof(*uses));
+	changed = calloc(n + 1, sizeof(*changed));
+	memset(&plan, 0, sizeof(plan));
+	plan.recs = calloc(n + 1, sizeof(*plan.recs));
+	plan.job = job;
+	if (!uses || !changed || !plan.recs) {
+		fprintf(stderr, "error, out of memory\n");
+		r = 1;
+		goto out;
+	}
+	
+	memset(used, 0, sizeof(used));
+	m = 0;
+	for (i = 0; i < n; i++) {
+		if (!(devs[i]->ident_valid & PCAN_IDENT_DEVICE_IDS)) {
+			fprintf(stderr, "warning, device ids of %s unknown, not checked\n", devs[i]->port_path);
+			continue;
+		}
+		
+		for (ch = 0; ch < devs[i]->pcan_type->n_channels; ch++) {
+			uses[m].id = devs[i]->device_ids[ch];
+			uses[m].dev = i;
+			uses[m].ch = ch;
+			m++;
+			
+			if (devs[i]->device_ids[ch] <= UCHAR_MAX)
+				used[devs[i]->device_ids[ch] / 64] |= 1ull << (devs[i]->device_ids[ch] % 64);
+		}
+	}
+	qsort(uses, m, sizeof(*uses), pcan_id_use_cmp);
+	
+	collisions = 0;
+	for (i = 0; i < m; i = j) {
+		for (j = i + 1; j < m && uses[j].id == uses[i].id; j++)
+			;
+		if (j - i == 1)
+			continue;
+		
+		printf("device id 0x%x used by", uses[i].id);
+		for (k = i; k < j; k++) {
+			struct pcan_ctx *dev = devs[uses[k].dev];
+			
+			if (dev->pcan_type->n_channels == 1)
+				printf(" %s", dev->port_path);
+			else
+				printf(" %s[%d]", dev->port_path, uses[k].ch);
+		}
+		printf("\n");
+		
+		/* the first user keeps the id */
+		for (k = i + 1; k < j; k++) {
+			struct pcan_ctx *dev = devs[uses[k].dev];
+			
+			collisions++;
+			if (!assign)
+				continue;
+			
+			id = pcan_id_alloc(used, dev->pcan_type->device_id_max < UCHAR_MAX ? dev->pcan_type->device_id_max : UCHAR_MAX);
+			if (id < 0) {
+				fprintf(stderr, "error, no free device id left for %s\n", dev->port_path);
+				continue;
+			}
+			
+			rec = pcan_snapshot_find(&plan, dev->port_path);
+			if (!rec) {
+				rec = &plan.recs[plan.n++];
+				pcan_snapshot_fill(rec, dev);
+				rec->ident_valid = PCAN_IDENT_DEVICE_IDS;
+				changed[plan.n - 1] = dev;
+			}
+			rec->device_ids[uses[k].ch] = id;
+		}
+	}
+	
+	if (collisions == 0) {
+		printf("no device id collisions\n");
+		r = 0;
+		goto out;
+	}
+	
+	if (!assign) {
+		r = 1;
+		goto out;
+	}
+	
+	printf("\n");
+	r = pcan_restore_run(&plan, changed, plan.n, jobs, hub_resets) != 0;
+	
+out:
+	free(plan.recs);
+	free(changed);
+	free(uses);
+	
+	return r;
+}
+
+
+/*
+ * Latency probe
+ *
+ * --ping reads the device ids of every claimed adapter N times, all adapters
+ * at once, and records the round-trip times in a high dynamic range
+ * histogram: values below 2^PCAN_HDR_SUB_BITS us are counted exactly, larger
+ * ones in buckets of 1/2^(PCAN_HDR_SUB_BITS - 1) relative width, so every
+ * percentile is within 2% from 1 us up to the transfer timeout and beyond.
+ */
+
+#define PCAN_HDR_SUB_BITS 7
+#define PCAN_HDR_SUB_COUNT (1 << PCAN_HDR_SUB_BITS)
+#define PCAN_HDR_HALF_COUNT (PCAN_HDR_SUB_COUNT / 2)
+#define PCAN_HDR_BUCKETS (PCAN_HDR_SUB_COUNT + (64 - PCAN_HDR_SUB_BITS) * PCAN_HDR_HALF_COUNT)
+
+struct pcan_hdr {
+	uint64_t counts[PCAN_HDR_BUCKETS];
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+	uint64_t failed;
+};
+
+static int pcan_hdr_index(uint64_t value)
+{
+	int msb, shift;
+	
+	if (value < PCAN_HDR_SUB_COUNT)
+		return value;
+	
+	msb = 63 - __builtin_clzll(value);
+	shift = msb - (PCAN_HDR_SUB_BITS - 1);
+	
+	return PCAN_HDR_SUB_COUNT + (shift - 1) * PCAN_HDR_HALF_COUNT + (value >> shift) - PCAN_HDR_HALF_COUNT;
+}
+
+/* highest value counted in bucket idx */
+static uint64_t pcan_hdr_value(int idx)
+{
+	int shift;
+	uint64_t sub;
+	
+	if (idx < PCAN_HDR_SUB_COUNT)
+		return idx;
+	
+	shift = (idx - PCAN_HDR_SUB_COUNT) / PCAN_HDR_HALF_COUNT + 1;
+	sub = (idx - PCAN_HDR_SUB_COUNT) % PCAN_HDR_HALF_COUNT + PCAN_HDR_HALF_COUNT;
+	
+	return ((sub + 1) << shift) - 1;
+}
+
+static void pcan_hdr_record(struct pcan_hdr *hdr, uint64_t value)
+{
+	hdr->counts[pcan_hdr_index(value)]++;
+	if (hdr->total == 0 || value < hdr->min)
+		hdr->min = value;
+	if (value > hdr->max)
+		hdr->max = value;
+	hdr->total++;
+}
+
+/* value at or below which permille / 10 percent of the samples are */
+static uint64_t pcan_hdr_percentile(struct pcan_hdr *hdr, unsigned int permille)
+{
+	uint64_t rank, seen;
+	int i;
+	
+	rank = (hdr->total * permille + 999) / 1000;
+	if (rank == 0)
+		rank = 1;
+	
+	seen = 0;
+	for (i = 0; i < PCAN_HDR_BUCKETS; i++) {
+		seen += hdr->counts[i];
+		if (seen >= rank)
+			return pcan_hdr_value(i) < hdr->max ? pcan_hdr_value(i) : hdr->max;
+	}
+	
+	return hdr->max;
+}
+
+struct pcan_ping {
+	struct pcan_job *job;
+	uint32_t count;
+};
+
+static int pcan_ping_job(struct pcan_ctx *ctx, void *arg)
+{
+	struct pcan_ping *ping = arg;
+	const struct pcan_proto *proto = ctx->pcan_type->proto;
+	uint32_t ids[PCAN_MAX_CHANNELS];
+	struct pcan_hdr *hdr;
+	struct pcan_job job;
+	uint64_t start_us;
+	uint32_t i;
+	int r;
+	
+	/* a reset would only add to the latency being measured */
+	job = *ping->job;
+	pcan_job_set(&job, 'q');
+	if (pcan_claim_job(ctx, &job))
+		return 1;
+	
+	hdr = calloc(1, sizeof(*hdr));
+	if (!hdr) {
+		fprintf(stderr, "error, out of memory\n");
+		return 1;
+	}
+	
+	for (i = 0; i < ping->count && !pcan_cancel_signal; i++) {
+		start_us = pcan_now_us();
+		if (proto->get_device_ids(ctx, ids, ctx->pcan_type->n_channels) == 0)
+			pcan_hdr_record(hdr, pcan_now_us() - start_us);
+		else
+			hdr->failed++;
+	}
+	
+	fprintf(ctx->out, "%20s: %llu ok, %llu failed\n", "ping",
+		   (unsigned long long) hdr->total, (unsigned long long) hdr->failed);
+	if (hdr->total) {
+		fprintf(ctx->out, "%20s: min %llu, p50 %llu, p99 %llu, p99.9 %llu, max %llu us\n", "latency",
+			   (unsigned long long) hdr->min,
+			   (unsigned long long) pcan_hdr_percentile(hdr, 500),
+			   (unsigned long long) pcan_hdr_percentile(hdr, 990),
+			   (unsigned long long) pcan_hdr_percentile(hdr, 999),
+			   (unsigned long long) hdr->max);
+	}
+	
+	r = hdr->failed || hdr->total < ping->count;
+	free(hdr);
+	
+	return r;
+}
+
+/*
+ * Inventory
+ *
+ * The adapters of a long running mode with hash indexes on port path, CAN
+ * interface name, serial number and device id. Every adapter gets an entry
+ * whose id stays the same until it is removed. The keys of an entry are a
+ * copy taken by pcan_inventory_update(), so an index never refers to a value
+ * that changed behind its back. generation increases with every change.
+ *
+ * The indexes use linear probing and backward shift deletion. An adapter has
+ * one key in each index per channel at most, and device ids may collide, in
+ * which case a lookup returns one of the adapters.
+ */
+
+#define PCAN_INV_MIN_SLOTS 16
+
+struct pcan_inv_slot {
+	uint32_t hash;
+	/* entry id, -1 if the slot is free */
+	int entry;
+};
+
+struct pcan_inv_index {
+	struct pcan_inv_slot *slots;
+	uint32_t size;
+	uint32_t used;
+};
+
+struct pcan_inv_entry {
+	/* 0 if the entry is free */
+	struct pcan_ctx *dev;
+	struct pcan_shm_adapter keys;
+};
+
+struct pcan_inventory {
+	struct pcan_inv_entry *entries;
+	int n_entries;
+	int n;
+	
+	struct pcan_inv_index index[PCAN_SHM_KEY_DEVICE_ID + 1];
+	uint64_t generation;
+};
+
+static uint32_t pcan_inv_hash(enum pcan_shm_key key, const char *name, uint32_t value)
+{
+	uint32_t h;
+	
+	if (key == PCAN_SHM_KEY_PATH || key == PCAN_SHM_KEY_NETDEV) {
+		/* FNV-1a */
+		for (h = 2166136261u; *name; name++)
+			h = (h ^ (uint8_t) *name) * 16777619u;
+		return h;
+	}
+	
+	h = value * 0x9e3779b1u;
+	
+	return h ^ (h >> 16);
+}
+
+/* id of an adapter with the given key, see pcan_shm_find() for name and value */
+static int pcan_inventory_find(struct pcan_inventory *inv, enum pcan_shm_key key, const char *name, uint32_t value)
+{
+	struct pcan_inv_index *index = &inv->index[key];
+	uint32_t h, i;
+	
+	if (!index->size)
+		return -1;
+	
+	h = pcan_inv_hash(key, name, value);
+	for (i = h & (index->size - 1); index->slots[i].entry >= 0; i = (i + 1) & (index->size - 1)) {
+		if (index->slots[i].hash == h &&
+			pcan_shm_match(&inv->entries[index->slots[i].entry].keys, key, name, value))
+			return index->slots[i].entry;
+	}
+	
+	return -1;
+}
+
+static int pcan_inv_insert(struct pcan_inv_index *index, uint32_t hash, int entry);
+
+static int pcan_inv_grow(struct pcan_inv_index *index)
+{
+	struct pcan_inv_index old = *index;
+	uint32_t i;
+	
+	index->size = old.size ? old.size * 2 : PCAN_INV_MIN_SLOTS;
+	index->used = 0;
+	index->slots = malloc(index->size * sizeof(*index->slots));
+	if (!index->slots) {
+		*index = old;
+		return 1;
+	}
+	for (i = 0; i < index->size; i++)
+		index->slots[i].entry = -1;
+	
+	for (i = 0; i < old.size; i++) {
+		if (old.slots[i].entry >= 0)
+			pcan_inv_insert(index, old.slots[i].hash, old.slots[i].entry);
+	}
+	free(old.slots);
+	
+	return 0;
+}
+
+static int pcan_inv_insert(struct pcan_inv_index *index, uint32_t hash, int entry)
+{
+	uint32_t i;
+	
+	/* at most half full keeps probe sequences short */
+	if ((index->used + 1) * 2 > index->size && pcan_inv_grow(index))
+		return 1;
+	
+	for (i = hash & (index->size - 1); index->slots[i].entry >= 0; i = (i + 1) & (index->size - 1))
+		;
+	index->slots[i].hash = hash;
+	index->slots[i].entry = entry;
+	index->used++;
+	
+	return 0;
+}
+
+static void pcan_inv_delete(struct pcan_inv_index *index, uint32_t hash, int entry)
+{
+	uint32_t mask = index->size - 1;
+	uint32_t i, j, home;
+	
+	if (!index->size)
+		return;
+	
+	for (i = hash & mask; index->slots[i].entry >= 0; i = (i + 1) & mask) {
+		if (index->slots[i].hash == hash && index->slots[i].entry == entry)
+			break;
+	}
+	if (index->slots[i].entry < 0)
+		return;
+	
+	/* pull back later slots whose probe sequence passes through the hole */
+	for (j = (i + 1) & mask; index->slots[j].entry >= 0; j = (j + 1) & mask) {
+		home = index->slots[j].hash & mask;
+		if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+			continue;
+		index->slots[i] = index->slots[j];
+		i = j;
+	}
+	index->slots[i].entry = -1;
+	index->used--;
+}
+
+/* insert (del == 0) or delete the keys of entry id in all indexes */
+static int pcan_inv_keys(struct pcan_inventory *inv, int id, int del)
+{
+	struct pcan_shm_adapter *a = &inv->entries[id].keys;
+	struct pcan_inv_index *index;
+	uint32_t h;
+	int ch, r;
+	
+	r = 0;
+	
+	index = &inv->index[PCAN_SHM_KEY_PATH];
+	h = pcan_inv_hash(PCAN_SHM_KEY_PATH, a->port_path, 0);
+	if (del)
+		pcan_inv_delete(index, h, id);
+	else
+		r |= pcan_inv_insert(index, h, id);
+	
+	for (ch = 0; ch < a->n_channels; ch++) {
+		if (!a->netdev[ch][0])
+			continue;
+		index = &inv->index[PCAN_SHM_KEY_NETDEV];
+		h = pcan_inv_hash(PCAN_SHM_KEY_NETDEV, a->netdev[ch], 0);
+		if (del)
+			pcan_inv_delete(index, h, id);
+		else
+			r |= pcan_inv_insert(index, h, id);
+	}
+	
+	if (a->valid & PCAN_SHM_SERIAL) {
+		index = &inv->index[PCAN_SHM_KEY_SERIAL];
+		h = pcan_inv_hash(PCAN_SHM_KEY_SERIAL, 0, a->serial_nr);
+		if (del)
+			pcan_inv_delete(index, h, id);
+		else
+			r |= pcan_inv_insert(index, h, id);
+	}
+	
+	for (ch = 0; (a->valid & PCAN_SHM_DEVICE_IDS) && ch < a->n_channels; ch++) {
+		index = &inv->index[PCAN_SHM_KEY_DEVICE_ID];
+		h = pcan_inv_hash(PCAN_SHM_KEY_DEVICE_ID, 0, a->device_ids[ch]);
+		if (del)
+			pcan_inv_delete(index, h, id);
+		else
+			r |= pcan_inv_insert(index, h, id);
+	}
+	
+	return r;
+}
+
+/* the keys of dev as they are now, in the layout of pcan-shm.h */
+static void pcan_inventory_keys(struct pcan_shm_adapter *a, struct pcan_ctx *dev)
+{
+	memset(a, 0, sizeof(*a));
+	snprintf(a->port_path, sizeof(a->port_path), "%s", dev->port_path);
+	snprintf(a->type, sizeof(a->type), "%s", dev->pcan_type->name);
+	pcan_sysfs_netdevs(dev, a->netdev);
+	memcpy(a->device_ids, dev->device_ids, sizeof(a->device_ids));
+	a->serial_nr = dev->serial_nr;
+	a->n_channels = dev->pcan_type->n_channels;
+	a->valid = dev->ident_valid & (PCAN_IDENT_DEVICE_IDS | PCAN_IDENT_SERIAL);
+	a->state = (a->valid & PCAN_IDENT_DEVICE_IDS) ? PCAN_SHM_IDENTIFIED : PCAN_SHM_UNIDENTIFIED;
+}
+
+/* re-key entry id after its adapter was queried or written */
+static void pcan_inventory_update(struct pcan_inventory *inv, int id)
+{
+	struct pcan_shm_adapter keys;
+	
+	pcan_inventory_keys(&keys, inv->entries[id].dev);
+	if (!memcmp(&keys, &inv->entries[id].keys, sizeof(keys)))
+		return;
+	
+	pcan_inv_keys(inv, id, 1);
+	inv->entries[id].keys = keys;
+	if (pcan_inv_keys(inv, id, 0))
+		fprintf(stderr, "error, out of memory, %s cannot be looked up\n", keys.port_path);
+	inv->generation++;
+}
+
+/* returns the id of the new entry, -1 if out of memory */
+static int pcan_inventory_add(struct pcan_inventory *inv, struct pcan_ctx *dev)
+{
+	struct pcan_inv_entry *entries;
+	int id;
+	
+	for (id = 0; id < inv->n_entries && inv->entries[id].dev; id++)
+		;
+	if (id == inv->n_entries) {
+		entries = realloc(inv->entries, (inv->n_entries + 1) * sizeof(*entries));
+		if (!entries)
+			return -1;
+		inv->entries = entries;
+		inv->n_entries++;
+	}
+	
+	inv->entries[id].dev = dev;
+	pcan_inventory_keys(&inv->entries[id].keys, dev);
+	if (pcan_inv_keys(inv, id, 0)) {
+		pcan_inv_keys(inv, id, 1);
+		inv->entries[id].dev = 0;
+		return -1;
+	}
+	inv->n++;
+	inv->generation++;
+	
+	return id;
+}
+
+static void pcan_inventory_remove(struct pcan_inventory *inv, int id)
+{
+	pcan_inv_keys(inv, id, 1);
+	inv->entries[id].dev = 0;
+	inv->n--;
+	inv->generation++;
+}
+
+/* frees the indexes, not the adapters */
+static void pcan_inventory_free(struct pcan_inventory *inv)
+{
+	unsigned int i;
+	
+	for (i = 0; i < sizeof(inv->index) / sizeof(inv->index[0]); i++)
+		free(inv->index[i].slots);
+	free(inv->entries);
+	memset(inv, 0, sizeof(*inv));
+}
+
+/*
+ * Shared memory inventory
+ *
+ * With --shm, watch mode publishes its inventory after every tick in the
+ * layout of pcan-shm.h. The segment is only written if something changed, so
+ * the generation counts actual changes. On exit an empty inventory is
+ * published before the name is removed, readers that still map the segment
+ * then find nothing instead of stale adapters.
+ */
+
+_Static_assert(PCAN_SHM_MAX_CHANNELS == PCAN_MAX_CHANNELS, "pcan-shm.h channel count");
+_Static_assert(PCAN_SHM_PATH_LEN == PCAN_PORT_PATH_LEN, "pcan-shm.h port path length");
+
+static struct pcan_shm *pcan_shm_create(const char *name)
+{
+	struct pcan_shm *shm;
+	int fd;
+	
+	fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "error, cannot create shared memory %s: %s\n", name, strerror(errno));
+		return 0;
+	}
+	if (ftruncate(fd, sizeof(*shm)) < 0) {
+		fprintf(stderr, "error, cannot resize shared memory %s: %s\n", name, strerror(errno));
+		close(fd);
+		return 0;
+	}
+	shm = mmap(0, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		fprintf(stderr, "error, cannot map shared memory %s: %s\n", name, strerror(errno));
+		return 0;
+	}
+	
+	/* a segment left by an earlier run keeps counting its generation */
+	if (shm->magic != PCAN_SHM_MAGIC || shm->version != PCAN_SHM_VERSION) {
+		__atomic_store_n(&shm->seq, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		shm->n = 0;
+		shm->total = 0;
+		shm->generation = 0;
+		shm->version = PCAN_SHM_VERSION;
+		shm->magic = PCAN_SHM_MAGIC;
+		__atomic_store_n(&shm->seq, 2, __ATOMIC_RELEASE);
+	} else if (shm->seq & 1) {
+		/* the last writer died in an update */
+		__atomic_store_n(&shm->seq, shm->seq + 1, __ATOMIC_RELEASE);
+	}
+	
+	return shm;
+}
+
+/* write inv to shm if it differs from what shm holds, we are the only writer */
+static void pcan_shm_publish(struct pcan_shm *shm, struct pcan_inventory *inv)
+{
+	struct pcan_shm_adapter adapters[PCAN_SHM_MAX_ADAPTERS];
+	uint32_t seq, total;
+	int i, n;
+	
+	n = 0;
+	total = 0;
+	for (i = 0; inv && i < inv->n_entries; i++) {
+		if (!inv->entries[i].dev)
+			continue;
+		if (n < PCAN_SHM_MAX_ADAPTERS)
+			adapters[n++] = inv->entries[i].keys;
+		total++;
+	}
+	
+	if (shm->n == (uint32_t) n && shm->total == total && !memcmp(shm->adapters, adapters, n * sizeof(adapters[0])))
+		return;
+	
+	if (total > PCAN_SHM_MAX_ADAPTERS && shm->total <= PCAN_SHM_MAX_ADAPTERS)
+		fprintf(stderr, "warning, %u adapters present, only %d of them are published in shared memory\n",
+				total, PCAN_SHM_MAX_ADAPTERS);
+	
+	seq = shm->seq;
+	__atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	
+	memcpy(shm->adapters, adapters, n * sizeof(adapters[0]));
+	__atomic_store_n(&shm->n, n, __ATOMIC_RELAXED);
+	__atomic_store_n(&shm->total, total, __ATOMIC_RELAXED);
+	__atomic_store_n(&shm->generation, shm->generation + 1, __ATOMIC_RELAXED);
+	
+	__atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void pcan_shm_destroy(struct pcan_shm *shm, const char *name)
+{
+	pcan_shm_publish(shm, 0);
+	shm_unlink(name);
+	munmap(shm, sizeof(*shm));
+}
+
+/*
+ * Hotplug events
+ *
+ * Where libusb hotplug does not work, e.g. in a container that only has
+ * /dev/bus/usb bind-mounted and runs no udev, --hotplug netlink reads the
+ * uevents of the kernel and --hotplug inotify watches the device nodes below
+ * /dev/bus/usb. Only events of adapters in pcan_types[] are passed on, each
+ * with what is needed to attach or drop that one adapter, so watch and serve
+ * mode update their inventory without enumerating the bus. Only if events
+ * were lost to an overflowing socket or inotify queue they enumerate again.
+ */
+
+enum pcan_hotplug {
+	PCAN_HOTPLUG_LIBUSB,
+	PCAN_HOTPLUG_NETLINK,
+	PCAN_HOTPLUG_INOTIFY,
+};
+
+/* multicast group of the kernel, udev forwards the events on group 2 */
+#define PCAN_UEVENT_GROUP_KERNEL 1
+#define PCAN_UEVENT_RCVBUF (1 << 20)
+#define PCAN_UEVENT_BUF_LEN 8192
+#define PCAN_UEVENT_MAX_BUSES 256
+
+struct pcan_uevent {
+	enum pcan_hotplug backend;
+	/* -1 with the libusb backend */
+	int fd;
+	
+	/* inotify watch descriptor of each bus directory, 0 if not watched */
+	int bus_wd[PCAN_UEVENT_MAX_BUSES];
+	
+	/* a netlink message, or inotify events not returned yet */
+	char buf[PCAN_UEVENT_BUF_LEN] __attribute__((aligned(__alignof__(struct inotify_event))));
+	size_t len, pos;
+};
+
+struct pcan_uevent_event {
+	/* 1 if the adapter arrived, 0 if it left */
+	int add;
+	int bus;
+	int address;
+	/* 0 for a removal seen by inotify, the node is gone by then */
+	struct pcan_type *type;
+	/* empty if unknown */
+	char port_path[PCAN_PORT_PATH_LEN];
+};
+
+/* port path of usbfs node bus/address, resolved through its /sys/dev/char link */
+static int pcan_sysfs_port_path(int bus, int address, char *buf, size_t len)
+{
+	char path[64], target[PATH_MAX];
+	const char *name;
+	ssize_t n;
+	
+	snprintf(path, sizeof(path), "%s/%d:%d", PCAN_SYSFS_DEV_CHAR, PCAN_USB_DEVICE_MAJOR, (bus - 1) * 128 + address - 1);
+	n = readlink(path, target, sizeof(target) - 1);
+	if (n <= 0)
+		return -1;
+	target[n] = 0;
+	
+	name = strrchr(target, '/');
+	name = name ? name + 1 : target;
+	if (strlen(name) >= len)
+		return -1;
+	strcpy(buf, name);
+	
+	return 0;
+}
+
+static void pcan_uevent_watch_bus(struct pcan_uevent *ue, int bus)
+{
+	char path[64];
+	int wd;
+	
+	if (bus <= 0 || bus >= PCAN_UEVENT_MAX_BUSES || ue->bus_wd[bus])
+		return;
+	
+	snprintf(path, sizeof(path), "%s/%03d", PCAN_DEV_BUS_USB, bus);
+	wd = inotify_add_watch(ue->fd, path, IN_CREATE | IN_DELETE | IN_ONLYDIR);
+	if (wd < 0) {
+		fprintf(stderr, "error, cannot watch %s: %s\n", path, strerror(errno));
+		return;
+	}
+	ue->bus_wd[bus] = wd;
+}
+
+static int pcan_uevent_open_netlink(struct pcan_uevent *ue)
+{
+	struct sockaddr_nl addr;
+	int size;
+	
+	ue->fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if (ue->fd < 0)
+		return 1;
+	
+	/* a hub full of adapters must not overflow the socket */
+	size = PCAN_UEVENT_RCVBUF;
+	setsockopt(ue->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = PCAN_UEVENT_GROUP_KERNEL;
+	if (bind(ue->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		close(ue->fd);
+		ue->fd = -1;
+		return 1;
+	}
+	
+	return 0;
+}
+
+static int pcan_uevent_open_inotify(struct pcan_uevent *ue)
+{
+	struct dirent *de;
+	DIR *dir;
+	
+	ue->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (ue->fd < 0)
+		return 1;
+	
+	/* bus directories appear with a host controller bound later */
+	dir = 0;
+	if (inotify_add_watch(ue->fd, PCAN_DEV_BUS_USB, IN_CREATE | IN_ONLYDIR) < 0 || !(dir = opendir(PCAN_DEV_BUS_USB))) {
+		close(ue->fd);
+		ue->fd = -1;
+		return 1;
+	}
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] != '.')
+			pcan_uevent_watch_bus(ue, atoi(de->d_name));
+	}
+	closedir(dir);
+	
+	return 0;
+}
+
+/* set up backend, falls back from netlink to inotify */
+static int pcan_uevent_open(struct pcan_uevent *ue, enum pcan_hotplug backend)
+{
+	memset(ue, 0, sizeof(*ue));
+	ue->backend = backend;
+	ue->fd = -1;
+	
+	/* a trace has no device nodes */
+	if (backend == PCAN_HOTPLUG_LIBUSB || pcan_replaying()) {
+		ue->backend = PCAN_HOTPLUG_LIBUSB;
+		return 0;
+	}
+	
+	if (backend == PCAN_HOTPLUG_NETLINK) {
+		if (pcan_uevent_open_netlink(ue) == 0)
+			return 0;
+		fprintf(stderr, "warning, cannot listen to uevents, watching %s instead: %s\n", PCAN_DEV_BUS_USB, strerror(errno));
+		ue->backend = PCAN_HOTPLUG_INOTIFY;
+	}
+	
+	if (pcan_uevent_open_inotify(ue)) {
+		fprintf(stderr, "error, cannot watch %s: %s\n", PCAN_DEV_BUS_USB, strerror(errno));
+		return 1;
+	}
+	
+	return 0;
+}
+
+static void pcan_uevent_close(struct pcan_uevent *ue)
+{
+	if (ue->fd >= 0)
+		close(ue->fd);
+	ue->fd = -1;
+}
+
+/* fill ev from a kernel uevent, 0 if it is about a supported adapter */
+static int pcan_uevent_parse(char *msg, size_t len, struct pcan_uevent_event *ev)
+{
+	const char *action, *devpath, *subsystem, *devtype, *product, *name;
+	unsigned int vendor_id, product_id;
+	char *p;
+	
+	action = devpath = subsystem = devtype = product = 0;
+	memset(ev, 0, sizeof(*ev));
+	
+	/* "<action>@<devpath>" followed by KEY=value, each NUL terminated */
+	for (p = msg; p < msg + len; p += strlen(p) + 1) {
+		if (!strncmp(p, "ACTION=", 7))
+			action = p + 7;
+		else if (!strncmp(p, "DEVPATH=", 8))
+			devpath = p + 8;
+		else if (!strncmp(p, "SUBSYSTEM=", 10))
+			subsystem = p + 10;
+		else if (!strncmp(p, "DEVTYPE=", 8))
+			devtype = p + 8;
+		else if (!strncmp(p, "PRODUCT=", 8))
+			product = p + 8;
+		else if (!strncmp(p, "BUSNUM=", 7))
+			ev->bus = atoi(p + 7);
+		else if (!strncmp(p, "DEVNUM=", 7))
+			ev->address = atoi(p + 7);
+	}
+	
+	/* interfaces of the adapter have their own events */
+	if (!action || !subsystem || strcmp(subsystem, "usb") || !devtype || strcmp(devtype, "usb_device") || !product)
+		return 1;
+	if (!strcmp(action, "add"))
+		ev->add = 1;
+	else if (strcmp(action, "remove"))
+		return 1;
+	
+	/* <vendor>/<product>/<bcdDevice> in hex without leading zeros */
+	if (sscanf(product, "%x/%x/", &vendor_id, &product_id) != 2)
+		return 1;
+	ev->type = pcan_lookup_type(vendor_id, product_id);
+	if (!ev->type || ev->bus <= 0 || ev->address <= 0)
+		return 1;
+	
+	if (devpath) {
+		name = strrchr(devpath, '/');
+		name = name ? name + 1 : devpath;
+		if (strlen(name) < sizeof(ev->port_path))
+			strcpy(ev->port_path, name);
+	}
+	
+	return 0;
+}
+
+static int pcan_uevent_read_netlink(struct pcan_uevent *ue, struct pcan_uevent_event *ev)
+{
+	struct sockaddr_nl addr;
+	socklen_t addr_len;
+	ssize_t n;
+	
+	for (;;) {
+		addr_len = sizeof(addr);
+		n = recvfrom(ue->fd, ue->buf, sizeof(ue->buf) - 1, 0, (struct sockaddr *) &addr, &addr_len);
+		if (n < 0)
+			return errno == ENOBUFS ? -1 : 0;
+		
+		/* only the kernel itself, not a process that joined the group */
+		if (addr.nl_pid != 0)
+			continue;
+		
+		ue->buf[n] = 0;
+		if (pcan_uevent_parse(ue->buf, n, ev) == 0)
+			return 1;
+	}
+}
+
+/* read the device descriptor of a new usbfs node, 0 if it is a supported adapter */
+static int pcan_uevent_probe(struct pcan_uevent_event *ev)
+{
+	unsigned char descr[LIBUSB_DT_DEVICE_SIZE];
+	uint16_t vendor_id, product_id;
+	char node[64];
+	ssize_t n;
+	int fd;
+	
+	snprintf(node, sizeof(node), "%s/%03d/%03d", PCAN_DEV_BUS_USB, ev->bus, ev->address);
+	fd = open(node, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 1;
+	n = read(fd, descr, sizeof(descr));
+	close(fd);
+	if (n != sizeof(descr))
+		return 1;
+	
+	/* usbfs returns these in host byte order */
+	memcpy(&vendor_id, descr + 8, sizeof(vendor_id));
+	memcpy(&product_id, descr + 10, sizeof(product_id));
+	ev->type = pcan_lookup_type(vendor_id, product_id);
+	if (!ev->type)
+		return 1;
+	
+	pcan_sysfs_port_path(ev->bus, ev->address, ev->port_path, sizeof(ev->port_path));
+	
+	return 0;
+}
+
+static int pcan_uevent_read_inotify(struct pcan_uevent *ue, struct pcan_uevent_event *ev)
+{
+	struct inotify_event *ie;
+	ssize_t n;
+	int bus;
+	
+	for (;;) {
+		if (ue->pos >= ue->len) {
+			n = read(ue->fd, ue->buf, sizeof(ue->buf));
+			if (n <= 0)
+				return 0;
+			ue->len = n;
+			ue->pos = 0;
+		}
+		ie = (struct inotify_event *) (ue->buf + ue->pos);
+		ue->pos += sizeof(*ie) + ie->len;
+		
+		if (ie->mask & IN_Q_OVERFLOW) {
+			ue->pos = ue->len;
+			return -1;
+		}
+		
+		for (bus = 1; bus < PCAN_UEVENT_MAX_BUSES && ue->bus_wd[bus] != ie->wd; bus++)
+			;
+		if (ie->mask & IN_IGNORED) {
+			if (bus < PCAN_UEVENT_MAX_BUSES)
+				ue->bus_wd[bus] = 0;
+			continue;
+		}
+		if (!ie->len)
+			continue;
+		
+		if (bus == PCAN_UEVENT_MAX_BUSES) {
+			if (ie->mask & IN_CREATE)
+				pcan_uevent_watch_bus(ue, atoi(ie->name));
+			continue;
+		}
+		
+		memset(ev, 0, sizeof(*ev));
+		ev->bus = bus;
+		ev->address = atoi(ie->name);
+		if (ev->address <= 0)
+			continue;
+		
+		/* removals cannot be filtered, they only match adapters we hold */
+		if (ie->mask & IN_DELETE)
+			return 1;
+		if ((ie->mask & IN_CREATE) && pcan_uevent_probe(ev) == 0) {
+			ev->add = 1;
+			return 1;
+		}
+	}
+}
+
+/*
+ * Next event without blocking. Returns 1 if ev was filled, 0 if there is none
+ * and -1 if events were lost, the caller has to enumerate then.
+ */
+static int pcan_uevent_read(struct pcan_uevent *ue, struct pcan_uevent_event *ev)
+{
+	if (ue->backend == PCAN_HOTPLUG_NETLINK)
+		return pcan_uevent_read_netlink(ue, ev);
+	if (ue->backend == PCAN_HOTPLUG_INOTIFY)
+		return pcan_uevent_read_inotify(ue, ev);
+	
+	return 0;
+}
+
+/* nonzero if ev is about dev */
+static int pcan_uevent_match(struct pcan_ctx *dev, struct pcan_uevent_event *ev)
+{
+	return dev->device && dev->bus == ev->bus && libusb_get_device_address(dev->device) == ev->address;
+}
+
+/*
+ * Referenced libusb device of the node ev names, 0 if it cannot be had. The
+ * node is wrapped where libusb can (1.0.23 and later), which needs no device
+ * list at all. Older libusb finds it by bus and address in the list.
+ */
+static libusb_device *pcan_uevent_device(struct libusb_context *usb_ctx, struct pcan_uevent_event *ev)
+{
+	libusb_device *device;
+	#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000107)
+	libusb_device_handle *handle;
+	char node[64];
+	int fd, r;
+	
+	snprintf(node, sizeof(node), "%s/%03d/%03d", PCAN_DEV_BUS_USB, ev->bus, ev->address);
+	fd = open(node, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "error, cannot open %s: %s\n", node, strerror(errno));
+		return 0;
+	}
+	r = libusb_wrap_sys_device(usb_ctx, fd, &handle);
+	if (r < 0) {
+		fprintf(stderr, "error, cannot attach %s: %s\n", node, libusb_strerror(r));
+		close(fd);
+		return 0;
+	}
+	
+	/* outlives the handle, pcan_open_device() opens the device again */
+	device = libusb_ref_device(libusb_get_device(handle));
+	
+	/* libusb_close() leaves the wrapped descriptor open */
+	libusb_close(handle);
+	close(fd);
+	#else
+	libusb_device **devices;
+	ssize_t cnt, c;
+	
+	cnt = libusb_get_device_list(usb_ctx, &devices);
+	if (cnt < 0) {
+		fprintf(stderr, "error retrieving list of devices: %s\n", libusb_strerror(cnt));
+		return 0;
+	}
+	
+	device = 0;
+	for (c = 0; c < cnt && !device; c++) {
+		if (libusb_get_bus_number(devices[c]) == ev->bus && libusb_get_device_address(devices[c]) == ev->address)
+			device = libusb_ref_device(devices[c]);
+	}
+	libusb_free_device_list(devices, 1);
+	
+	if (!device)
+		fprintf(stderr, "error, libusb does not list %03d/%03d\n", ev->bus, ev->address);
+	#endif
+	
+	return device;
+}
+
+/*
+ * New ctx for the adapter of an add event. libusb knows no parent or port
+ * numbers of a wrapped device, so the port path from the event or sysfs is
+ * what re-enumeration and power cycling go by.
+ */
+static struct pcan_ctx *pcan_uevent_attach(struct libusb_context *usb_ctx, struct pcan_uevent_event *ev)
+{
+	libusb_device *device;
+	struct pcan_ctx *dev;
+	
+	device = pcan_uevent_device(usb_ctx, ev);
+	if (!device)
+		return 0;
+	
+	dev = calloc(1, sizeof(*dev));
+	if (!dev) {
+		fprintf(stderr, "error, out of memory\n");
+		libusb_unref_device(device);
+		return 0;
+	}
+	
+	dev->usb_ctx = usb_ctx;
+	dev->device = device;
+	libusb_get_device_descriptor(dev->device, &dev->dev_descr);
+	dev->pcan_type = ev->type;
+	dev->lock_fd = -1;
+	dev->out = stdout;
+	dev->bus = ev->bus;
+	
+	/* libusb knows no topology for a wrapped device */
+	if (ev->port_path[0])
+		memcpy(dev->port_path, ev->port_path, sizeof(dev->port_path));
+	else if (pcan_sysfs_port_path(ev->bus, ev->address, dev->port_path, sizeof(dev->port_path)))
+		snprintf(dev->port_path, sizeof(dev->port_path), "%d:%d", ev->bus, ev->address);
+	
+	return dev;
+}
+
+/*
+ * Watch mode
+ *
+ * One libusb context and one open handle per adapter are kept for the whole
+ * run. The set of adapters is only re-enumerated after a hotplug event, or,
+ * if libusb lacks hotplug support, when the bus numbers and addresses of the
+ * device list changed since the last tick. A line is printed only if an
+ * adapter appeared, vanished or reported a different identity. With
+ * --hotplug netlink or inotify, adapters are attached and dropped one by one
+ * as their events arrive instead.
+ *
+ * An adapter is claimed to read its identity only until that succeeded once.
+ * After that its ids are refreshed from sysfs where peak_usb exports them and
+ * taken from the cache otherwise. Writing an adapter resets it, so it comes
+ * back as a new device and is read again.
+ */
+
+struct pcan_watch {
+	struct libusb_context *usb_ctx;
+	struct pcan_ctx **devs;
+	int n;
+	
+	struct pcan_inventory inv;
+	struct pcan_uevent ue;
+	
+	/* enumerate again before the next tick */
+	int rescan;
+	/* device list at the last poll without hotplug, see pcan_watch_poll() */
+	ssize_t poll_n;
+	uint64_t poll_sig;
+	/* an event was applied, do not wait for the tick */
+	int changed;
+};
+
+static int LIBUSB_CALL pcan_watch_hotplug_cb(libusb_context *usb_ctx, libusb_device *device, libusb_hotplug_event event, void *user_data)
+{
+	struct pcan_watch *watch = user_data;
+	
+	(void) usb_ctx;
+	(void) device;
+	(void) event;
+	watch->rescan = 1;
+	
+	return 0;
+}
+
+static void pcan_watch_forget(struct pcan_watch *watch, struct pcan_ctx *dev)
+{
+	int id;
+	
+	printf("%s %s removed\n", dev->port_path, dev->pcan_type->name);
+	id = pcan_inventory_find(&watch->inv, PCAN_SHM_KEY_PATH, dev->port_path, 0);
+	if (id >= 0)
+		pcan_inventory_remove(&watch->inv, id);
+	pcan_release_device(dev);
+	free(dev);
+}
+
+/* merge a fresh enumeration into watch->devs, keeping handles of known devices */
+static int pcan_watch_rescan(struct pcan_watch *watch)
+{
+	struct pcan_ctx **devs, **merged;
+	int i, j, n, m;
+	
+	n = pcan_fleet_enumerate(watch->usb_ctx, &devs);
+	if (n < 0)
+		return 1;
+	
+	merged = calloc(n + 1, sizeof(*merged));
+	if (!merged) {
+		pcan_fleet_free(devs, n);
+		return 1;
+	}
+	
+	m = 0;
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < watch->n; j++) {
+			if (watch->devs[j] && watch->devs[j]->device == devs[i]->device &&
+				!strcmp(watch->devs[j]->port_path, devs[i]->port_path))
+				break;
+		}
+		
+		if (j < watch->n) {
+			merged[m++] = watch->devs[j];
+			watch->devs[j] = 0;
+			pcan_release_device(devs[i]);
+			free(devs[i]);
+			continue;
+		}
+		
+		if (pcan_open_device(devs[i])) {
+			pcan_release_device(devs[i]);
+			free(devs[i]);
+			continue;
+		}
+		merged[m++] = devs[i];
+	}
+	free(devs);
+	
+	for (j = 0; j < watch->n; j++) {
+		if (watch->devs[j])
+			pcan_watch_forget(watch, watch->devs[j]);
+	}
+	free(watch->devs);
+	
+	watch->devs = merged;
+	watch->n = m;
+	
+	return 0;
+}
+
+/*
+ * Without hotplug support the device list is polled. Only bus numbers and
+ * addresses are compared, which reads no descriptor and opens nothing.
+ * Returns nonzero if the set of devices changed since the last poll.
+ */
+static int pcan_watch_poll(struct pcan_watch *watch)
+{
+	libusb_device **devices;
+	uint64_t sig;
+	ssize_t cnt, c;
+	
+	cnt = libusb_get_device_list(watch->usb_ctx, &devices);
+	if (cnt < 0)
+		return 1;
+	
+	/* a sum, so the order of the list does not matter */
+	sig = 0;
+	for (c = 0; c < cnt; c++)
+		sig += ((uint64_t) libusb_get_bus_number(devices[c]) << 8 | libusb_get_device_address(devices[c])) * 0x9e3779b97f4a7c15ull;
+	libusb_free_device_list(devices, 1);
+	
+	if (cnt == watch->poll_n && sig == watch->poll_sig)
+		return 0;
+	watch->poll_n = cnt;
+	watch->poll_sig = sig;
+	
+	return 1;
+}
+
+/* identity of dev for this tick, dev is claimed only until its ids were read */
+static void pcan_watch_refresh(struct pcan_ctx *dev)
+{
+	uint32_t ids[PCAN_MAX_CHANNELS];
+	
+	if (!(dev->ident_valid & PCAN_IDENT_DEVICE_IDS)) {
+		pcan_query_identity(dev);
+		return;
+	}
+	
+	if (!dev->replay && pcan_sysfs_device_ids(dev, ids) == 0)
+		memcpy(dev->device_ids, ids, dev->pcan_type->n_channels * sizeof(ids[0]));
+}
+
+/* apply pending events of watch->ue to watch->devs */
+static void pcan_watch_events(struct pcan_watch *watch)
+{
+	struct pcan_uevent_event ev;
+	struct pcan_ctx *dev, **devs;
+	int i, r;
+	
+	while ((r = pcan_uevent_read(&watch->ue, &ev)) != 0) {
+		if (r < 0) {
+			watch->rescan = 1;
+			continue;
+		}
+		
+		for (i = 0; i < watch->n && !pcan_uevent_match(watch->devs[i], &ev); i++)
+			;
+		
+		if (!ev.add) {
+			if (i == watch->n)
+				continue;
+			pcan_watch_forget(watch, watch->devs[i]);
+			memmove(&watch->devs[i], &watch->devs[i + 1], (watch->n - i - 1) * sizeof(*watch->devs));
+			watch->n--;
+			watch->changed = 1;
+			continue;
+		}
+		
+		/* already known, e.g. from the enumeration at the start */
+		if (i < watch->n)
+			continue;
+		
+		dev = pcan_uevent_attach(watch->usb_ctx, &ev);
+		if (!dev)
+			continue;
+		devs = realloc(watch->devs, (watch->n + 1) * sizeof(*devs));
+		if (devs)
+			watch->devs = devs;
+		if (!devs || pcan_open_device(dev)) {
+			pcan_release_device(dev);
+			free(dev);
+			continue;
+		}
+		watch->devs[watch->n++] = dev;
+		watch->changed = 1;
+	}
+}
+
+static int pcan_watch_run(struct libusb_context *usb_ctx, uint32_t interval_ms, const char *metrics_path, const char *shm_name,
+						  enum pcan_hotplug backend)
+{
+	struct pcan_watch watch;
+	struct pcan_shm *shm;
+	libusb_hotplug_callback_handle hotplug;
+	uint32_t ids[PCAN_MAX_CHANNELS], serial_nr;
+	uint8_t valid;
+	struct pollfd pfd;
+	struct timeval tv;
+	uint32_t waited;
+	int i, id, has_hotplug;
+	
+	memset(&watch, 0, sizeof(watch));
+	watch.usb_ctx = usb_ctx;
+	watch.rescan = 1;
+	
+	/* opened before the first enumeration, so no adapter slips through */
+	if (pcan_uevent_open(&watch.ue, backend))
+		return 1;
+	
+	shm = 0;
+	if (shm_name) {
+		shm = pcan_shm_create(shm_name);
+		if (!shm) {
+			pcan_uevent_close(&watch.ue);
+			return 1;
+		}
+	}
+	
+	has_hotplug = watch.ue.backend == PCAN_HOTPLUG_LIBUSB && libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+		libusb_hotplug_register_callback(usb_ctx,
+					LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+					LIBUSB_HOTPLUG_NO_FLAGS,
+					PCAN_VENDOR_ID,
+					LIBUSB_HOTPLUG_MATCH_ANY,
+					LIBUSB_HOTPLUG_MATCH_ANY,
+					pcan_watch_hotplug_cb,
+					&watch,
+					&hotplug) == LIBUSB_SUCCESS;
+	
+	while (!pcan_cancel_signal) {
+		if (!has_hotplug && watch.ue.fd < 0 && pcan_watch_poll(&watch))
+			watch.rescan = 1;
+		if (watch.rescan) {
+			watch.rescan = 0;
+			pcan_watch_rescan(&watch);
+		}
+		watch.changed = 0;
+		
+		for (i = 0; i < watch.n && !pcan_cancel_signal; i++) {
+			struct pcan_ctx *dev = watch.devs[i];
+			
+			memcpy(ids, dev->device_ids, sizeof(ids));
+			serial_nr = dev->serial_nr;
+			valid = dev->ident_valid;
+			
+			pcan_watch_refresh(dev);
+			
+			if (!(valid & PCAN_IDENT_SEEN) ||
+				dev->ident_valid != (valid | PCAN_IDENT_SEEN) ||
+				memcmp(ids, dev->device_ids, sizeof(ids)) ||
+				serial_nr != dev->serial_nr)
+			{
+				dev->ident_valid |= PCAN_IDENT_SEEN;
+				pcan_print_identity(dev, stdout);
+			}
+			
+			id = pcan_inventory_find(&watch.inv, PCAN_SHM_KEY_PATH, dev->port_path, 0);
+			if (id < 0)
+				pcan_inventory_add(&watch.inv, dev);
+			else
+				pcan_inventory_update(&watch.inv, id);
+		}
+		fflush(stdout);
+		
+		if (metrics_path)
+			pcan_metrics_write(metrics_path, watch.devs, watch.n);
+		if (shm)
+			pcan_shm_publish(shm, &watch.inv);
+		
+		/* sleep while dispatching hotplug events */
+		for (waited = 0; waited < interval_ms && !pcan_cancel_signal && !watch.rescan && !watch.changed; waited += PCAN_CANCEL_POLL_MS) {
+			if (watch.ue.fd >= 0) {
+				pfd.fd = watch.ue.fd;
+				pfd.events = POLLIN;
+				if (poll(&pfd, 1, PCAN_CANCEL_POLL_MS) > 0)
+					pcan_watch_events(&watch);
+				continue;
+			}
+			
+			tv.tv_sec = 0;
+			tv.tv_usec = PCAN_CANCEL_POLL_MS * 1000;
+			libusb_handle_events_timeout_completed(usb_ctx, &tv, 0);
+		}
+	}
+	
+	if (has_hotplug)
+		libusb_hotplug_deregister_callback(usb_ctx, hotplug);
+	pcan_uevent_close(&watch.ue);
+	
+	if (shm)
+		pcan_shm_destroy(shm, shm_name);
+	
+	for (i = 0; i < watch.n; i++) {
+		pcan_release_device(watch.devs[i]);
+		free(watch.devs[i]);
+	}
+	free(watch.devs);
+	pcan_inventory_free(&watch.inv);
+	
+	return 0;
+}
+
+void help(FILE *fd) {
+	fprintf(fd, "Usage: pcan-id [options]\n");
+	fprintf(fd, "\n");
+	fprintf(fd, "Options:\n");
+	fprintf(fd, "\n");
+	fprintf(fd, "-h           Show this help\n");
+	fprintf(fd, "-a           Apply -q to all devices in parallel\n");
+	fprintf(fd, "-d <number>  Device index (default: 0)\n");
+	fprintf(fd, "-i <number>  Set device id, a comma-separated list sets the ids\n");
+	fprintf(fd, "             of multiple channels at once (e.g. 3,4 or ,4)\n");
+	fprintf(fd, "-l           List devices\n");	
+	fprintf(fd, "-q           Query serial number and device id\n");
+	fprintf(fd, "-s <number>  Set serial number\n");
+	fprintf(fd, "\n");
+	fprintf(fd, "--assign-ids        Like --check-ids, then give the lowest free ids to\n");
+	fprintf(fd, "                    all but the first adapter of every collision\n");
+	fprintf(fd, "--atomic            With --restore or --assign-ids, roll all adapters\n");
+	fprintf(fd, "                    back to their previous ids if one of them fails\n");
+	fprintf(fd, "--batch             Run commands from stdin on adapters kept open,\n");
+	fprintf(fd, "                    printing one JSON result per line\n");
+	fprintf(fd, "--check-ids         Query all devices and report device id collisions\n");
+	fprintf(fd, "--deadline <ms>     Cancel the run after <ms> milliseconds, releasing\n");
+	fprintf(fd, "                    the adapter to its kernel driver\n");
+	fprintf(fd, "--dry-run           Print the writes -i, -s, --restore or --assign-ids\n");
+	fprintf(fd, "                    would make and their cost, without resetting\n");
+	fprintf(fd, "--hotplug <backend> How --watch and --serve learn of adapters: libusb\n");
+	fprintf(fd, "                    (default), netlink uevents or inotify on %s\n", PCAN_DEV_BUS_USB);
+	fprintf(fd, "--hub-resets <n>    Concurrent resets behind one hub with -a (default: %d)\n", PCAN_FLEET_HUB_RESETS);
+	fprintf(fd, "--idle-exit <ms>    End --serve after <ms> milliseconds without a client\n");
+	fprintf(fd, "--jobs <n>          Adapters handled in parallel with -a (default: %d)\n", PCAN_FLEET_JOBS);
+	fprintf(fd, "--lock <mode>       Per-device lock: wait (default), try, none or a\n");
+	fprintf(fd, "                    timeout in milliseconds\n");
+	fprintf(fd, "--metrics <file>    Write adapter inventory and transfer statistics to\n");
+	fprintf(fd, "                    <file> for the Prometheus textfile collector\n");
+	fprintf(fd, "--no-daemon         Access USB directly even if a server is running\n");
+	fprintf(fd, "--ping <n>          Read the device ids of all adapters <n> times in\n");
+	fprintf(fd, "                    parallel and print latency percentiles\n");
+	fprintf(fd, "--power-cycle       Power cycle the hub port of an adapter that stops\n");
+	fprintf(fd, "                    answering and retry once\n");
+	fprintf(fd, "--record <file>     Record all USB transfers to a trace file\n");
+	fprintf(fd, "--replay <file>     Serve devices and responses from a recorded trace\n");
+	fprintf(fd, "--replay-speed <x>  Replay timing factor, 1 is the recorded timing and 0\n");
+	fprintf(fd, "                    disables delays (default: 1)\n");
+	fprintf(fd, "--restore <file>    Write the ids and serial numbers of a snapshot to\n");
+	fprintf(fd, "                    all adapters that drifted from it\n");
+	fprintf(fd, "--serve             Keep all adapters open and run batch commands\n");
+	fprintf(fd, "                    arriving on the socket, -l, -q, -i and -s use it\n");
+	fprintf(fd, "--shm <name>        With --watch, publish the adapters in POSIX shared\n");
+	fprintf(fd, "                    memory <name> (e.g. /pcan-id), see pcan-shm.h\n");
+	fprintf(fd, "--snapshot <file>   Query all devices and save their identities\n");
+	fprintf(fd, "--snapshot-text <file>\n");
+	fprintf(fd, "                    Same as --snapshot in a readable form\n");
+	fprintf(fd, "--socket <path>     Socket of --serve (default: %s)\n", PCAN_SOCKET_PATH);
+	fprintf(fd, "--watch <ms>        Poll all devices every <ms> milliseconds and print\n");
+	fprintf(fd, "                    a line whenever a device or its identity changes\n");
+}
+
+char parse_long(char *arg, uint32_t *value) {
+	long long int val;
+	char *endptr;
+	
+	if ('0' <= arg[0] && arg[0] <= '9') {
+		errno = 0;
+		if (arg[0] == '0' && arg[1] == 'x') {
+			val = strtoll(arg, &endptr, 16);
+		} else {
+			val = strtoll(arg, &endptr, 10);
+		}
+		
+		if (endptr) {
+			if (errno == ERANGE && (val == LLONG_MAX || val == LLONG_MIN)) {
+				fprintf(stderr, "range error\n");
+				return 1;
+			}
+			
+			if (errno != 0 && val == 0) {
+				fprintf(stderr, "No digits were found\n");
+				return 1;
+			}
+			
+			if (endptr == arg) {
+				fprintf(stderr, "No digits were found\n");
+				return 1;
+			}
+		}
+	} else {
+		fprintf(stderr, "invalid argument: %s\n", arg);
+		return 1;
+	}
+	
+	*value = val;
+	
+	return 0;
+}
+
+/* parse "<id>[,<id>...]", an empty field leaves that channel untouched */
+char parse_id_list(char *arg, uint32_t *ids, uint32_t *mask) {
+	char *field, *next;
+	int ch;
+	
+	*mask = 0;
+	field = arg;
+	for (ch = 0; field; ch++) {
+		next = strchr(field, ',');
+		if (next)
+			*next++ = 0;
+		
+		if (ch >= PCAN_MAX_CHANNELS) {
+			fprintf(stderr, "too many device ids, at most %d channels supported\n", PCAN_MAX_CHANNELS);
+			return 1;
+		}
+		
+		if (*field) {
+			if (parse_long(field, &ids[ch]))
+				return 1;
+			*mask |= 1 << ch;
+		}
+		
+		field = next;
+	}
+	
+	if (*mask == 0) {
+		fprintf(stderr, "No device id given\n");
+		return 1;
+	}
+	
+	return 0;
+}
+
+/*
+ * Batch mode
+ *
+ * Commands are read line by line from stdin, one result is written per line
+ * to stdout as a JSON object. An adapter is opened, locked, claimed and
+ * reset the first time a command addresses it and stays so until the end of
+ * the batch, so further commands cost only their USB transfers.
+ *
+ *   list
+ *   query <selector>
+ *   set-id <selector> <id>[,<id>...]
+ *   set-serial <selector> <serial>
+ *   release <selector>
+ *
+ * A selector is path=<port path>, netdev=<CAN interface>, serial=<serial
+ * number>, id=<device id>, index=<n> or device=<n>. index is the slot in the
+ * batch, which an adapter keeps across hotplug, device is its number in
+ * pcan-id -l. Lines may be of any length.
+ */
+
+struct pcan_batch {
+	struct pcan_ctx **devs;
+	uint8_t *ready;
+	int n;
+	
+	/* entry ids are indexes into devs, devs[i] is 0 once its adapter left */
+	struct pcan_inventory inv;
+	
+	/* results, stdout or a --serve connection */
+	FILE *out;
+	
+	/* lock settings */
+	struct pcan_job *job;
+	
+	struct libusb_context *usb_ctx;
+	
+	/* --serve: query without claiming, see pcan_batch_peek() */
+	uint8_t transient;
+};
+
+/*
+ * Number every adapter of batch as browse_devices() does for -l and -d,
+ * direct[i] is -1 if devs[i] is not in the device list. The list comes from
+ * libusb's cache, no adapter is opened.
+ */
+static void pcan_batch_direct_order(struct pcan_batch *batch, int *direct)
+{
+	struct libusb_device_descriptor descr;
+	struct pcan_trace_rec *rec;
+	libusb_device **devices;
+	ssize_t cnt, c;
+	int i, k;
+	
+	for (i = 0; i < batch->n; i++)
+		direct[i] = -1;
+	
+	if (pcan_replaying()) {
+		for (k = 0; (rec = pcan_replay_device(k)); k++) {
+			for (i = 0; i < batch->n; i++) {
+				if (batch->devs[i] && !strcmp(batch->devs[i]->port_path, rec->port_path))
+					direct[i] = k;
+			}
+		}
+		return;
+	}
+	
+	cnt = libusb_get_device_list(batch->usb_ctx, &devices);
+	if (cnt < 0)
+		return;
+	
+	/* by bus and address, which also finds adapters wrapped by the uevent backends */
+	for (c = 0, k = 0; c < cnt; c++) {
+		if (libusb_get_device_descriptor(devices[c], &descr) < 0)
+			break;
+		if (!pcan_lookup_type(descr.idVendor, descr.idProduct))
+			continue;
+		
+		for (i = 0; i < batch->n; i++) {
+			if (batch->devs[i] && batch->devs[i]->device &&
+				libusb_get_bus_number(batch->devs[i]->device) == libusb_get_bus_number(devices[c]) &&
+				libusb_get_device_address(batch->devs[i]->device) == libusb_get_device_address(devices[c]))
+				direct[i] = k;
+		}
+		k++;
+	}
+	libusb_free_device_list(devices, 1);
+}
+
+/* open and prepare devs[i] unless it is already */
+static int pcan_batch_ready(struct pcan_batch *batch, int i)
+{
+	struct pcan_job job;
+	
+	if (batch->ready[i])
+		return 0;
+	
+	job = *batch->job;
+	pcan_job_set(&job, 'q');
+	if (pcan_open_device(batch->devs[i]) || pcan_prepare_device(batch->devs[i], &job)) {
+		pcan_close_device(batch->devs[i]);
+		return 1;
+	}
+	if (!batch->devs[i]->replay)
+		pcan_read_strings(batch->devs[i]);
+	batch->ready[i] = 1;
+	
+	return 0;
+}
+
+/*
+ * Read the identity of devs[i] and leave the adapter as a direct -q does.
+ * The ids come from sysfs while peak_usb is bound and the serial number from
+ * the inventory once it is known. Only what neither has is read over USB,
+ * claimed without a reset, and the interface goes back to the kernel driver.
+ */
+static int pcan_batch_peek(struct pcan_batch *batch, int i)
+{
+	struct pcan_ctx *dev = batch->devs[i];
+	struct pcan_job job;
+	int r;
+	
+	if (batch->ready[i])
+		return pcan_read_identity(dev);
+	
+	if (pcan_open_device(dev)) {
+		pcan_close_device(dev);
+		return 1;
+	}
+	if (!dev->replay)
+		pcan_read_strings(dev);
+	
+	r = pcan_query_identity(dev);
+	if (r || !(dev->ident_valid & PCAN_IDENT_SERIAL)) {
+		job = *batch->job;
+		pcan_job_set(&job, 'q');
+		r = pcan_claim_job(dev, &job);
+		if (r == 0)
+			r = pcan_read_identity(dev);
+	}
+	pcan_close_device(dev);
+	
+	return r;
+}
+
+/* give every adapter of batch back to its kernel driver */
+static void pcan_batch_release(struct pcan_batch *batch)
+{
+	int i;
+	
+	for (i = 0; i < batch->n; i++) {
+		if (batch->ready[i])
+			pcan_close_device(batch->devs[i]);
+		batch->ready[i] = 0;
+	}
+}
+
+/*
+ * Look key up in the inventory. If it is not there, claim the adapters whose
+ * identity is not known yet and read it until the key shows up.
+ */
+static int pcan_batch_find(struct pcan_batch *batch, enum pcan_shm_key key, uint32_t value)
+{
+	struct pcan_ctx *dev;
+	int i, id;
+	
+	id = pcan_inventory_find(&batch->inv, key, 0, value);
+	for (i = 0; id < 0 && i < batch->n; i++) {
+		dev = batch->devs[i];
+		if (!dev || ((dev->ident_valid & PCAN_IDENT_DEVICE_IDS) && (dev->ident_valid & PCAN_IDENT_SERIAL)))
+			continue;
+		
+		if (pcan_batch_ready(batch, i) == 0)
+			pcan_read_identity(dev);
+		pcan_inventory_update(&batch->inv, i);
+		id = pcan_inventory_find(&batch->inv, key, 0, value);
+	}
+	
+	return id;
+}
+
+/* ",key":"str" with quotes, backslashes and control characters escaped */
+static void pcan_json_put_str(FILE *out, const char *key, const char *str)
+{
+	fprintf(out, ",\"%s\":\"", key);
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(out, "\\%c", *str);
+		else if ((unsigned char) *str < 0x20)
+			fprintf(out, "\\u%04x", (unsigned char) *str);
+		else
+			fputc(*str, out);
+	}
+	fputc('"', out);
+}
+
+/* index of the adapter numbered n by pcan-id -l, -1 if there is none */
+static int pcan_batch_find_direct(struct pcan_batch *batch, uint32_t n)
+{
+	int *direct;
+	int i;
+	
+	direct = calloc(batch->n + 1, sizeof(*direct));
+	if (!direct)
+		return -1;
+	
+	pcan_batch_direct_order(batch, direct);
+	for (i = 0; i < batch->n && (direct[i] < 0 || (uint32_t) direct[i] != n); i++)
+		;
+	free(direct);
+	
+	return i < batch->n ? i : -1;
+}
+
+/* index of the device sel refers to, -1 with *err set if there is none */
+static int pcan_batch_select(struct pcan_batch *batch, char *sel, const char **err)
+{
+	uint32_t value;
+	int i;
+	
+	*err = "invalid selector";
+	if (!sel)
+		return -1;
+	
+	if (!strncmp(sel, "path=", 5)) {
+		i = pcan_inventory_find(&batch->inv, PCAN_SHM_KEY_PATH, sel + 5, 0);
+	} else if (!strncmp(sel, "netdev=", 7)) {
+		i = pcan_inventory_find(&batch->inv, PCAN_SHM_KEY_NETDEV, sel + 7, 0);
+	} else if (!strncmp(sel, "index=", 6)) {
+		if (parse_long(sel + 6, &value))
+			return -1;
+		i = value < (uint32_t) batch->n && batch->devs[value] ? (int) value : -1;
+	} else if (!strncmp(sel, "device=", 7)) {
+		if (parse_long(sel + 7, &value))
+			return -1;
+		i = pcan_batch_find_direct(batch, value);
+	} else if (!strncmp(sel, "serial=", 7)) {
+		if (parse_long(sel + 7, &value))
+			return -1;
+		i = pcan_batch_find(batch, PCAN_SHM_KEY_SERIAL, value);
+	} else if (!strncmp(sel, "id=", 3)) {
+		if (parse_long(sel + 3, &value))
+			return -1;
+		i = pcan_batch_find(batch, PCAN_SHM_KEY_DEVICE_ID, value);
+	} else {
+		return -1;
+	}
+	
+	if (i < 0)
+		*err = "no such device";
+	
+	return i;
+}
+
+static void pcan_batch_print_ids(FILE *out, struct pcan_ctx *dev, const uint32_t *ids)
+{
+	int ch;
+	
+	fprintf(out, ",\"device_id\":[");
+	for (ch = 0; ch < dev->pcan_type->n_channels; ch++)
+		fprintf(out, "%s%u", ch ? "," : "", ids[ch]);
+	fprintf(out, "]");
+}
+
+/* the header a direct run prints, for forwarded runs */
+static void pcan_batch_print_strings(FILE *out, struct pcan_ctx *dev)
+{
+	if (dev->manufacturer[0])
+		pcan_json_put_str(out, "manufacturer", dev->manufacturer);
+	if (dev->product[0])
+		pcan_json_put_str(out, "product", dev->product);
+}
+
+/* execute one command line, returns non-zero if it failed */
+static int pcan_batch_exec(struct pcan_batch *batch, char *line, int lineno)
+{
+	const struct pcan_proto *proto;
+	struct pcan_ctx *dev;
+	struct pcan_job job;
+	const char *err;
+	char *cmd, *sel, *arg, *save;
+	int i, n, ch, r, *direct;
+	
+	cmd = strtok_r(line, " \t\r\n", &save);
+	if (!cmd || cmd[0] == '#')
+		return 0;
+	
+	if (!strcmp(cmd, "list")) {
+		direct = calloc(batch->n + 1, sizeof(*direct));
+		if (!direct) {
+			fprintf(batch->out, "{\"line\":%d,\"cmd\":\"list\",\"ok\":false,\"error\":\"out of memory\"}\n", lineno);
+			return 1;
+		}
+		pcan_batch_direct_order(batch, direct);
+		
+		fprintf(batch->out, "{\"line\":%d,\"cmd\":\"list\",\"ok\":true,\"generation\":%llu,\"devices\":[",
+			   lineno, (unsigned long long) batch->inv.generation);
+		for (i = 0, n = 0; i < batch->n; i++) {
+			dev = batch->devs[i];
+			if (!dev)
+				continue;
+			fprintf(batch->out, "%s{\"index\":%d,\"device\":%d", n++ ? "," : "", i, direct[i]);
+			pcan_json_put_str(batch->out, "path", dev->port_path);
+			pcan_json_put_str(batch->out, "type", dev->pcan_type->name);
+			fprintf(batch->out, ",\"vendor_id\":%u,\"product_id\":%u,\"bus\":%d,\"address\":%d}",
+				   dev->pcan_type->vendor_id, dev->pcan_type->product_id, dev->bus,
+				   dev->device ? libusb_get_device_address(dev->device) : 0);
+		}
+		fprintf(batch->out, "]}\n");
+		free(direct);
+		return 0;
+	}
+	
+	if (strcmp(cmd, "query") && strcmp(cmd, "set-id") && strcmp(cmd, "set-serial") && strcmp(cmd, "release")) {
+		fprintf(batch->out, "{\"line\":%d,\"ok\":false,\"error\":\"unknown command\"}\n", lineno);
+		return 1;
+	}
+	
+	sel = strtok_r(0, " \t\r\n", &save);
+	arg = strtok_r(0, " \t\r\n", &save);
+	i = pcan_batch_select(batch, sel, &err);
+	if (i < 0)
+		goto fail;
+	dev = batch->devs[i];
+	proto = dev->pcan_type->proto;
+	
+	if (!strcmp(cmd, "release")) {
+		if (batch->ready[i])
+			pcan_close_device(dev);
+		batch->ready[i] = 0;
+		fprintf(batch->out, "{\"line\":%d,\"cmd\":\"release\",\"ok\":true", lineno);
+		pcan_json_put_str(batch->out, "path", dev->port_path);
+		fprintf(batch->out, "}\n");
+		return 0;
+	}
+	
+	job = *batch->job;
+	if (!strcmp(cmd, "set-id")) {
+		err = "invalid device id";
+		if (!arg || parse_id_list(arg, job.device_ids, &job.device_id_mask))
+			goto fail;
+		pcan_job_set(&job, 'i');
+	} else if (!strcmp(cmd, "set-serial")) {
+		err = "invalid serial number";
+		if (!arg || parse_long(arg, &job.serial_nr))
+			goto fail;
+		pcan_job_set(&job, 's');
+	} else {
+		pcan_job_set(&job, 'q');
+	}
+	
+	err = "invalid argument for this adapter";
+	if (pcan_check_job(dev, &job))
+		goto fail;
+	
+	err = "cannot claim the adapter";
+	if (!(batch->transient && job.action == 'q') && pcan_batch_ready(batch, i))
+		goto fail;
+	
+	err = "transfer failed";
+	if (job.action == 'i') {
+		r = proto->set_device_ids(dev, job.device_ids, job.device_id_mask, dev->pcan_type->n_channels);
+		if (r)
+			goto fail;
+		for (ch = 0; ch < dev->pcan_type->n_channels; ch++) {
+			if (job.device_id_mask & (1 << ch))
+				dev->device_ids[ch] = job.device_ids[ch];
+		}
+		if (job.device_id_mask == (1u << dev->pcan_type->n_channels) - 1)
+			dev->ident_valid |= PCAN_IDENT_DEVICE_IDS;
+		pcan_inventory_update(&batch->inv, i);
+		fprintf(batch->out, "{\"line\":%d,\"cmd\":\"set-id\",\"ok\":true", lineno);
+		pcan_json_put_str(batch->out, "path", dev->port_path);
+		pcan_batch_print_ids(batch->out, dev, job.device_ids);
+		pcan_batch_print_strings(batch->out, dev);
+		fprintf(batch->out, "}\n");
+	} else if (job.action == 's') {
+		r = proto->set_serial(dev, job.serial_nr);
+		if (r)
+			goto fail;
+		dev->serial_nr = job.serial_nr;
+		dev->ident_valid |= PCAN_IDENT_SERIAL;
+		pcan_inventory_update(&batch->inv, i);
+		fprintf(batch->out, "{\"line\":%d,\"cmd\":\"set-serial\",\"ok\":true", lineno);
+		pcan_json_put_str(batch->out, "path", dev->port_path);
+		fprintf(batch->out, ",\"serial_number\":%u", job.serial_nr);
+		pcan_batch_print_strings(batch->out, dev);
+		fprintf(batch->out, "}\n");
+	} else {
+		r = batch->transient ? pcan_batch_peek(batch, i) : pcan_read_identity(dev);
+		pcan_inventory_update(&batch->inv, i);
+		if (r)
+			goto fail;
+		fprintf(batch->out, "{\"line\":%d,\"cmd\":\"query\",\"ok\":true", lineno);
+		pcan_json_put_str(batch->out, "path", dev->port_path);
+		pcan_json_put_str(batch->out, "type", dev->pcan_type->name);
+		pcan_batch_print_ids(batch->out, dev, dev->device_ids);
+		pcan_batch_print_strings(batch->out, dev);
+		fprintf(batch->out, ",\"serial_number\":%u}\n", dev->serial_nr);
+	}
+	
+	return 0;
+	
+fail:
+	fprintf(batch->out, "{\"line\":%d", lineno);
+	pcan_json_put_str(batch->out, "cmd", cmd);
+	fprintf(batch->out, ",\"ok\":false");
+	pcan_json_put_str(batch->out, "error", err);
+	fprintf(batch->out, "}\n");
+	
+	return 1;
+}
+
+static void pcan_batch_free(struct pcan_batch *batch)
+{
+	pcan_inventory_free(&batch->inv);
+	pcan_fleet_free(batch->devs, batch->n);
+	free(batch->ready);
+	batch->devs = 0;
+	batch->ready = 0;
+	batch->n = 0;
+}
+
+/* take over dev, which arrived, returns its index or -1 if out of memory */
+static int pcan_batch_add(struct pcan_batch *batch, struct pcan_ctx *dev)
+{
+	struct pcan_ctx **devs;
+	uint8_t *ready;
+	int i;
+	
+	/* the inventory reuses the lowest free id, which is the lowest free slot */
+	i = pcan_inventory_add(&batch->inv, dev);
+	if (i == batch->n) {
+		devs = realloc(batch->devs, (batch->n + 1) * sizeof(*devs));
+		if (devs)
+			batch->devs = devs;
+		ready = realloc(batch->ready, batch->n + 1);
+		if (ready)
+			batch->ready = ready;
+		if (!devs || !ready) {
+			pcan_inventory_remove(&batch->inv, i);
+			i = -1;
+		} else {
+			batch->n++;
+		}
+	}
+	if (i < 0) {
+		fprintf(stderr, "error, out of memory\n");
+		return -1;
+	}
+	
+	dev->out = stderr;
+	batch->devs[i] = dev;
+	batch->ready[i] = 0;
+	
+	return i;
+}
+
+/* drop devs[i], which left */
+static void pcan_batch_remove(struct pcan_batch *batch, int i)
+{
+	pcan_inventory_remove(&batch->inv, i);
+	pcan_release_device(batch->devs[i]);
+	free(batch->devs[i]);
+	batch->devs[i] = 0;
+	batch->ready[i] = 0;
+}
+
+/* enumerate the adapters for a batch, none of them is opened yet */
+static int pcan_batch_init(struct pcan_batch *batch, struct libusb_context *usb_ctx)
+{
+	int i;
+	
+	batch->usb_ctx = usb_ctx;
+	batch->n = pcan_fleet_enumerate(usb_ctx, &batch->devs);
+	if (batch->n < 0) {
+		batch->n = 0;
+		return 1;
+	}
+	
+	batch->ready = calloc(batch->n + 1, 1);
+	if (!batch->ready) {
+		fprintf(stderr, "error, out of memory\n");
+		pcan_batch_free(batch);
+		return 1;
+	}
+	
+	/* keep stdout for the results */
+	for (i = 0; i < batch->n; i++) {
+		batch->devs[i]->out = stderr;
+		if (pcan_inventory_add(&batch->inv, batch->devs[i]) != i) {
+			fprintf(stderr, "error, out of memory\n");
+			pcan_batch_free(batch);
+			return 1;
+		}
+	}
+	
+	return 0;
+}
+
+/* run the commands on stdin, returns non-zero if any of them failed */
+static int pcan_batch_run(struct libusb_context *usb_ctx, struct pcan_job *job)
+{
+	struct pcan_batch batch;
+	size_t size;
+	char *line;
+	int lineno, failed;
+	
+	memset(&batch, 0, sizeof(batch));
+	batch.job = job;
+	batch.out = stdout;
+	if (pcan_batch_init(&batch, usb_ctx))
+		return 1;
+	
+	failed = 0;
+	line = 0;
+	size = 0;
+	for (lineno = 1; !pcan_cancel_signal && getline(&line, &size, stdin) >= 0; lineno++) {
+		failed |= pcan_batch_exec(&batch, line, lineno);
+		fflush(stdout);
+	}
+	free(line);
+	
+	pcan_batch_free(&batch);
+	
+	return failed;
+}
+
+/*
+ * Serve mode
+ *
+ * --serve answers the commands of batch mode on a Unix socket, one connection
+ * at a time. The inventory is kept across connections, so a query is
+ * answered from sysfs and the inventory where it can. Adapters claimed for
+ * writes go back to their kernel driver when the connection ends, which
+ * leaves the CAN interfaces as a direct run does. After a hotplug event the adapters are enumerated
+ * again before the next connection is accepted, without hotplug support in
+ * libusb they are enumerated once. With --hotplug netlink or inotify an
+ * adapter is added or dropped by its event alone and the others keep their
+ * index.
+ *
+ * Started by systemd socket activation, the server takes the socket from
+ * there. libusb is only initialized when the first client connects, and with
+ * --idle-exit the server ends after a quiet period until systemd starts it
+ * again for the next client.
+ */
+
+struct pcan_serve {
+	struct pcan_batch batch;
+	
+	/* 0 until the first client connects */
+	struct libusb_context *usb_ctx;
+	libusb_hotplug_callback_handle hotplug;
+	int has_hotplug;
+	int changed;
+	
+	struct pcan_uevent ue;
+};
+
+static int LIBUSB_CALL pcan_serve_hotplug_cb(libusb_context *usb_ctx, libusb_device *device, libusb_hotplug_event event, void *user_data)
+{
+	struct pcan_serve *serve = user_data;
+	
+	(void) usb_ctx;
+	(void) device;
+	(void) event;
+	serve->changed = 1;
+	
+	return 0;
+}
+
+static int pcan_socket_addr(struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		fprintf(stderr, "error, socket path too long: %s\n", path);
+		return 1;
+	}
+	strcpy(addr->sun_path, path);
+	
+	return 0;
+}
+
+/* connected socket to a server at path, -1 if none is running */
+static int pcan_socket_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+	
+	if (pcan_socket_addr(&addr, path))
+		return -1;
+	
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		close(fd);
+		return -1;
+	}
+	
+	return fd;
+}
+
+static int pcan_serve_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+	
+	if (pcan_socket_addr(&addr, path))
+		return -1;
+	
+	fd = pcan_socket_connect(path);
+	if (fd >= 0) {
+		fprintf(stderr, "error, another pcan-id serves %s\n", path);
+		close(fd);
+		return -1;
+	}
+	
+	if (!strcmp(path, PCAN_SOCKET_PATH) && mkdir(PCAN_LOCK_DIR, 0755) != 0 && errno != EEXIST) {
+		fprintf(stderr, "error, cannot create %s: %s\n", PCAN_LOCK_DIR, strerror(errno));
+		return -1;
+	}
+	
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		fprintf(stderr, "error, cannot create socket: %s\n", strerror(errno));
+		return -1;
+	}
+	
+	/* left behind by a server that died */
+	unlink(path);
+	
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+		fprintf(stderr, "error, cannot listen on %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	
+	return fd;
+}
+
+static void pcan_serve_client(struct pcan_serve *serve, int fd)
+{
+	struct timeval tv;
+	size_t size;
+	char *line;
+	FILE *in, *out;
+	int lineno;
+	
+	tv.tv_sec = PCAN_SERVE_CLIENT_TIMEOUT_MS / 1000;
+	tv.tv_usec = (PCAN_SERVE_CLIENT_TIMEOUT_MS % 1000) * 1000;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	
+	in = fdopen(fd, "r");
+	out = in ? fdopen(dup(fd), "w") : 0;
+	if (!out) {
+		if (in)
+			fclose(in);
+		else
+			close(fd);
+		return;
+	}
+	
+	serve->batch.out = out;
+	line = 0;
+	size = 0;
+	for (lineno = 1; !pcan_cancel_signal && getline(&line, &size, in) >= 0; lineno++) {
+		pcan_batch_exec(&serve->batch, line, lineno);
+		fflush(out);
+	}
+	free(line);
+	pcan_batch_release(&serve->batch);
+	serve->batch.out = stdout;
+	
+	fclose(out);
+	fclose(in);
+}
+
+/*
+ * Listening socket passed by systemd socket activation, -1 if there is none.
+ * Only the LISTEN_PID/LISTEN_FDS protocol is used, no libsystemd.
+ */
+static int pcan_serve_activated(void)
+{
+	const char *pid, *fds;
+	
+	pid = getenv("LISTEN_PID");
+	fds = getenv("LISTEN_FDS");
+	if (!pid || !fds || strtoul(pid, 0, 10) != (unsigned long) getpid() || strtoul(fds, 0, 10) < 1)
+		return -1;
+	
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+	if (fcntl(PCAN_LISTEN_FDS_START, F_SETFD, FD_CLOEXEC) < 0) {
+		fprintf(stderr, "error, no socket passed by activation: %s\n", strerror(errno));
+		return -1;
+	}
+	
+	return PCAN_LISTEN_FDS_START;
+}
+
+/* apply pending events of serve->ue to the batch */
+static void pcan_serve_events(struct pcan_serve *serve)
+{
+	struct pcan_batch *batch = &serve->batch;
+	struct pcan_uevent_event ev;
+	struct pcan_ctx *dev;
+	int i, r;
+	
+	while ((r = pcan_uevent_read(&serve->ue, &ev)) != 0) {
+		if (r < 0) {
+			serve->changed = 1;
+			continue;
+		}
+		
+		for (i = 0; i < batch->n && !(batch->devs[i] && pcan_uevent_match(batch->devs[i], &ev)); i++)
+			;
+		
+		if (!ev.add) {
+			if (i < batch->n)
+				pcan_batch_remove(batch, i);
+			continue;
+		}
+		
+		/* already known, e.g. back from the reset of a set-id */
+		if (i < batch->n)
+			continue;
+		
+		dev = pcan_uevent_attach(serve->usb_ctx, &ev);
+		if (dev && pcan_batch_add(batch, dev) < 0) {
+			pcan_release_device(dev);
+			free(dev);
+		}
+	}
+}
+
+/* initialize libusb and enumerate, deferred until the first client */
+static int pcan_serve_start(struct pcan_serve *serve, enum pcan_hotplug backend)
+{
+	if (libusb_init(&serve->usb_ctx) != 0) {
+		fprintf(stderr, "error initializing libusb\n");
+		serve->usb_ctx = 0;
+		return 1;
+	}
+	libusb_set_debug(serve->usb_ctx, 3);
+	
+	if (pcan_uevent_open(&serve->ue, backend)) {
+		libusb_exit(serve->usb_ctx);
+		serve->usb_ctx = 0;
+		return 1;
+	}
+	
+	pcan_batch_init(&serve->batch, serve->usb_ctx);
+	
+	serve->has_hotplug = serve->ue.backend == PCAN_HOTPLUG_LIBUSB && libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG) &&
+		libusb_hotplug_register_callback(serve->usb_ctx,
+					LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+					LIBUSB_HOTPLUG_NO_FLAGS,
+					PCAN_VENDOR_ID,
+					LIBUSB_HOTPLUG_MATCH_ANY,
+					LIBUSB_HOTPLUG_MATCH_ANY,
+					pcan_serve_hotplug_cb,
+					serve,
+					&serve->hotplug) == LIBUSB_SUCCESS;
+	
+	return 0;
+}
+
+/* serve until a signal, or until idle_ms passed without a client if not 0 */
+static int pcan_serve_run(struct pcan_job *job, const char *path, uint32_t idle_ms, enum pcan_hotplug backend)
+{
+	struct pcan_serve serve;
+	struct pollfd pfd[2];
+	struct timeval tv;
+	uint64_t idle_since_us;
+	int r, fd, activated;
+	
+	pfd[0].fd = pcan_serve_activated();
+	activated = pfd[0].fd >= 0;
+	if (!activated)
+		pfd[0].fd = pcan_serve_listen(path);
+	if (pfd[0].fd < 0)
+		return 1;
+	pfd[0].events = POLLIN;
+	pfd[1].events = POLLIN;
 	
-	if (action == 'q') {
-		/*
-		 * request device id
-		 */
-		
-		memset(pkt, 0, sizeof(pkt));
-		pkt[0] = 4;
-		pkt[1] = 1;
-		
-		// send request
-		r = libusb_bulk_transfer(ctx->dev_handle,
-							0x1,
-							pkt,
-							sizeof(pkt),
-							&transferred,
-							USB_TIMEOUT_MS);
-		
-		if (r != LIBUSB_SUCCESS)
-			printf("error %s\n", libusb_error_name(r));
-		
-		// get response
-		r = libusb_bulk_transfer(ctx->dev_handle,
-							0x81,
-							pkt,
-							sizeof(pkt),
-							&transferred,
-							USB_TIMEOUT_MS);
-		
-		if (r != LIBUSB_SUCCESS)
-			printf("error %s\n", libusb_error_name(r));
-		
-		device_id = pkt[2];
-		printf("%20s: 0x%x\n", "device_id", device_id);
-		
-		
+	memset(&serve, 0, sizeof(serve));
+	serve.batch.job = job;
+	serve.batch.out = stdout;
+	serve.batch.transient = 1;
+	serve.ue.fd = -1;
+	
+	/* a client that went away must not end the server */
+	signal(SIGPIPE, SIG_IGN);
+	
+	idle_since_us = pcan_now_us();
+	while (!pcan_cancel_signal) {
+		if (idle_ms && pcan_now_us() - idle_since_us >= idle_ms * 1000ull)
+			break;
 		
-		/*
-		 * request serial number
-		 */
+		/* poll() skips the event fd while it is -1 */
+		pfd[1].fd = serve.ue.fd;
+		r = poll(pfd, 2, PCAN_CANCEL_POLL_MS);
 		
-		memset(pkt, 0, sizeof(pkt));
-		pkt[0] = 6;
-		pkt[1] = 1;
+		if (serve.usb_ctx) {
+			tv.tv_sec = 0;
+			tv.tv_usec = 0;
+			libusb_handle_events_timeout_completed(serve.usb_ctx, &tv, 0);
+			if (r > 0 && pfd[1].revents)
+				pcan_serve_events(&serve);
+			if (serve.changed) {
+				serve.changed = 0;
+				pcan_batch_free(&serve.batch);
+				pcan_batch_init(&serve.batch, serve.usb_ctx);
+			}
+		}
 		
-		// send request
-		r = libusb_bulk_transfer(ctx->dev_handle,
-							0x1,
-							pkt,
-							sizeof(pkt),
-							&transferred,
-							USB_TIMEOUT_MS);
+		if (r <= 0 || !pfd[0].revents)
+			continue;
 		
-		if (r != LIBUSB_SUCCESS)
-			printf("error %s\n", libusb_error_name(r));
+		fd = accept(pfd[0].fd, 0, 0);
+		if (fd < 0)
+			continue;
 		
-		// get response
-		r = libusb_bulk_transfer(ctx->dev_handle,
-							0x81,
-							pkt,
-							sizeof(pkt),
-							&transferred,
-							USB_TIMEOUT_MS);
+		if (serve.usb_ctx || pcan_serve_start(&serve, backend) == 0)
+			pcan_serve_client(&serve, fd);
+		else
+			close(fd);
+		idle_since_us = pcan_now_us();
+	}
+	
+	if (serve.usb_ctx) {
+		if (serve.has_hotplug)
+			libusb_hotplug_deregister_callback(serve.usb_ctx, serve.hotplug);
+		pcan_uevent_close(&serve.ue);
+		pcan_batch_free(&serve.batch);
+		libusb_exit(serve.usb_ctx);
+	}
+	
+	/* an activated socket belongs to systemd */
+	close(pfd[0].fd);
+	if (!activated)
+		unlink(path);
+	
+	return 0;
+}
+
+/*
+ * Forwarding
+ *
+ * Unless --no-daemon is given, -l, -q, -i and -s go to a running --serve as
+ * batch commands, and its answers are printed the way a direct run prints
+ * them. The server keeps the slot of an adapter across hotplug, so -d goes
+ * out as device=<n>, which the server numbers as browse_devices() does. The
+ * client never initializes libusb. Only if no server accepts the connection
+ * pcan-id accesses USB itself.
+ */
+
+/* value of "key" in a JSON line of batch mode, 0 if it is missing */
+static const char *pcan_json_get(const char *json, const char *key)
+{
+	char pattern[64];
+	const char *p;
+	
+	snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+	p = strstr(json, pattern);
+	
+	return p ? p + strlen(pattern) : 0;
+}
+
+static uint32_t pcan_json_u32(const char *json, const char *key)
+{
+	const char *p = pcan_json_get(json, key);
+	
+	return p ? strtoul(p, 0, 10) : 0;
+}
+
+/* string value of key, unescaped as pcan_json_put_str() escapes it */
+static void pcan_json_str(const char *json, const char *key, char *buf, size_t len)
+{
+	const char *p = pcan_json_get(json, key);
+	char hex[5];
+	size_t i;
+	
+	i = 0;
+	if (p && *p == '"') {
+		for (p++; *p && *p != '"' && i + 1 < len; p++) {
+			if (*p == '\\' && p[1] == 'u' && strspn(p + 2, "0123456789abcdefABCDEF") >= 4) {
+				memcpy(hex, p + 2, 4);
+				hex[4] = 0;
+				buf[i++] = strtoul(hex, 0, 16);
+				p += 5;
+			} else if (*p == '\\' && p[1]) {
+				buf[i++] = *++p;
+			} else {
+				buf[i++] = *p;
+			}
+		}
+	}
+	buf[i] = 0;
+}
+
+/* send a command and read its answer, returns 0 if the command succeeded */
+static int pcan_forward_cmd(int fd, FILE *in, char **reply, size_t *len, const char *fmt, ...)
+{
+	char err[128];
+	va_list ap;
+	
+	va_start(ap, fmt);
+	vdprintf(fd, fmt, ap);
+	va_end(ap);
+	
+	if (getline(reply, len, in) < 0) {
+		fprintf(stderr, "error, lost the connection to the pcan-id server\n");
+		return 1;
+	}
+	
+	if (!strstr(*reply, "\"ok\":true")) {
+		pcan_json_str(*reply, "error", err, sizeof(err));
+		fprintf(stderr, "error, %s\n", err);
+		return 1;
+	}
+	
+	return 0;
+}
+
+/* the "device" number of the list entry at entry, -1 if it has none */
+static long pcan_forward_device(const char *entry)
+{
+	const char *p = pcan_json_get(entry, "device");
+	
+	return p ? strtol(p, 0, 10) : -1;
+}
+
+/* the server's adapters in the order and with the numbers of a direct run */
+static void pcan_forward_print_list(const char *reply)
+{
+	char type[64];
+	const char *p;
+	long i, max;
+	
+	max = -1;
+	for (p = reply; (p = strstr(p, "{\"index\":")); p++) {
+		if (pcan_forward_device(p) > max)
+			max = pcan_forward_device(p);
+	}
+	
+	for (i = 0; i <= max; i++) {
+		for (p = reply; (p = strstr(p, "{\"index\":")); p++) {
+			if (pcan_forward_device(p) != i)
+				continue;
+			pcan_json_str(p, "type", type, sizeof(type));
+			printf("%ld: %04x:%04x Bus %03u Device %03u \"%s\"\n", i,
+				   pcan_json_u32(p, "vendor_id"), pcan_json_u32(p, "product_id"),
+				   pcan_json_u32(p, "bus"), pcan_json_u32(p, "address"), type);
+			break;
+		}
+	}
+}
+
+/* the iManufacturer and iProduct lines a direct run starts with */
+static void pcan_forward_print_strings(const char *reply)
+{
+	struct pcan_ctx ctx;
+	
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.out = stdout;
+	pcan_json_str(reply, "manufacturer", ctx.manufacturer, sizeof(ctx.manufacturer));
+	pcan_json_str(reply, "product", ctx.product, sizeof(ctx.product));
+	pcan_print_strings(&ctx);
+}
+
+static void pcan_forward_print_query(const char *reply)
+{
+	struct pcan_ctx ctx;
+	char type[64];
+	const char *p;
+	char *end;
+	int ch;
+	size_t i;
+	
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.out = stdout;
+	pcan_json_str(reply, "type", type, sizeof(type));
+	for (i = 0; i < PCAN_N_TYPES && !ctx.pcan_type; i++) {
+		if (!strcmp(pcan_types[i].name, type))
+			ctx.pcan_type = &pcan_types[i];
+	}
+	if (!ctx.pcan_type)
+		return;
+	
+	p = pcan_json_get(reply, "device_id");
+	if (p && *p == '[') {
+		for (ch = 0, p++; ch < ctx.pcan_type->n_channels; ch++, p = end + 1) {
+			ctx.device_ids[ch] = strtoul(p, &end, 10);
+			if (end == p)
+				break;
+		}
+		if (ch == ctx.pcan_type->n_channels)
+			ctx.ident_valid |= PCAN_IDENT_DEVICE_IDS;
+	}
+	
+	if (pcan_json_get(reply, "serial_number")) {
+		ctx.serial_nr = pcan_json_u32(reply, "serial_number");
+		ctx.ident_valid |= PCAN_IDENT_SERIAL;
+	}
+	
+	pcan_print_query(&ctx);
+}
+
+/* run job on adapter device_idx through a server, -1 if none is running */
+static int pcan_forward_run(const char *path, struct pcan_job *job, uint32_t device_idx)
+{
+	char ids[PCAN_MAX_CHANNELS * 12], *reply;
+	size_t len, pos;
+	FILE *in;
+	int fd, i, ch, r, header;
+	
+	fd = pcan_socket_connect(path);
+	if (fd < 0)
+		return -1;
+	in = fdopen(dup(fd), "r");
+	if (!in) {
+		close(fd);
+		return -1;
+	}
+	
+	reply = 0;
+	len = 0;
+	if (job->action == 'l') {
+		r = pcan_forward_cmd(fd, in, &reply, &len, "list\n");
+		if (r == 0)
+			pcan_forward_print_list(reply);
+		goto out;
+	}
+	
+	r = 0;
+	header = 0;
+	for (i = 0; i < job->n_ops && r == 0; i++) {
+		switch (job->ops[i]) {
+			case 'i':
+				/* the -i syntax, channels not to set stay empty */
+				pos = 0;
+				ids[0] = 0;
+				for (ch = 0; ch < PCAN_MAX_CHANNELS && (job->device_id_mask >> ch); ch++) {
+					pos += snprintf(ids + pos, sizeof(ids) - pos, "%s", ch ? "," : "");
+					if (job->device_id_mask & (1 << ch))
+						pos += snprintf(ids + pos, sizeof(ids) - pos, "%u", job->device_ids[ch]);
+				}
+				r = pcan_forward_cmd(fd, in, &reply, &len, "set-id device=%u %s\n", device_idx, ids);
+				break;
+			case 's':
+				r = pcan_forward_cmd(fd, in, &reply, &len, "set-serial device=%u %u\n", device_idx, job->serial_nr);
+				break;
+			case 'q':
+				r = pcan_forward_cmd(fd, in, &reply, &len, "query device=%u\n", device_idx);
+				break;
+		}
+		if (r == 0 && !header) {
+			pcan_forward_print_strings(reply);
+			header = 1;
+		}
+		if (r == 0 && job->ops[i] == 'q')
+			pcan_forward_print_query(reply);
+	}
+	
+out:
+	free(reply);
+	fclose(in);
+	close(fd);
+	
+	return r != 0;
+}
+
+enum {
+	OPT_LOCK = 256,
+	OPT_DEADLINE,
+	OPT_JOBS,
+	OPT_HUB_RESETS,
+	OPT_WATCH,
+	OPT_METRICS,
+	OPT_RECORD,
+	OPT_REPLAY,
+	OPT_REPLAY_SPEED,
+	OPT_SNAPSHOT,
+	OPT_SNAPSHOT_TEXT,
+	OPT_RESTORE,
+	OPT_CHECK_IDS,
+	OPT_ASSIGN_IDS,
+	OPT_ATOMIC,
+	OPT_DRY_RUN,
+	OPT_BATCH,
+	OPT_PING,
+	OPT_POWER_CYCLE,
+	OPT_SHM,
+	OPT_SERVE,
+	OPT_SOCKET,
+	OPT_NO_DAEMON,
+	OPT_IDLE_EXIT,
+	OPT_HOTPLUG,
+};
+
+static const struct option long_options[] = {
+	{ "help", no_argument, 0, 'h' },
+	{ "lock", required_argument, 0, OPT_LOCK },
+	{ "deadline", required_argument, 0, OPT_DEADLINE },
+	{ "all", no_argument, 0, 'a' },
+	{ "jobs", required_argument, 0, OPT_JOBS },
+	{ "hub-resets", required_argument, 0, OPT_HUB_RESETS },
+	{ "watch", required_argument, 0, OPT_WATCH },
+	{ "metrics", required_argument, 0, OPT_METRICS },
+	{ "record", required_argument, 0, OPT_RECORD },
+	{ "replay", required_argument, 0, OPT_REPLAY },
+	{ "replay-speed", required_argument, 0, OPT_REPLAY_SPEED },
+	{ "snapshot", required_argument, 0, OPT_SNAPSHOT },
+	{ "snapshot-text", required_argument, 0, OPT_SNAPSHOT_TEXT },
+	{ "restore", required_argument, 0, OPT_RESTORE },
+	{ "check-ids", no_argument, 0, OPT_CHECK_IDS },
+	{ "assign-ids", no_argument, 0, OPT_ASSIGN_IDS },
+	{ "atomic", no_argument, 0, OPT_ATOMIC },
+	{ "dry-run", no_argument, 0, OPT_DRY_RUN },
+	{ "batch", no_argument, 0, OPT_BATCH },
+	{ "ping", required_argument, 0, OPT_PING },
+	{ "power-cycle", no_argument, 0, OPT_POWER_CYCLE },
+	{ "shm", required_argument, 0, OPT_SHM },
+	{ "serve", no_argument, 0, OPT_SERVE },
+	{ "socket", required_argument, 0, OPT_SOCKET },
+	{ "no-daemon", no_argument, 0, OPT_NO_DAEMON },
+	{ "idle-exit", required_argument, 0, OPT_IDLE_EXIT },
+	{ "hotplug", required_argument, 0, OPT_HOTPLUG },
+	{ 0, 0, 0, 0 },
+};
+
+int main(int argc, char **argv) {
+	int r, opt, n;
+	uint32_t deadline_ms;
+	uint32_t device_idx;
+	uint32_t jobs, hub_resets;
+	uint8_t jobs_given;
+	uint32_t ping_count;
+	uint32_t watch_ms, idle_exit_ms;
+	char *metrics_path, *shm_name, *socket_path;
+	uint8_t no_daemon;
+	enum pcan_hotplug hotplug;
+	char *record_path, *replay_path;
+	char *snapshot_path, *restore_path;
+	uint8_t snapshot_text;
+	uint8_t check_ids;
+	double replay_speed;
+	uint8_t all_devices;
+	struct libusb_context *usb_ctx;
+	struct pcan_ctx *ctx, **devs;
+	struct pcan_snapshot snap;
+	struct pcan_job job;
+	
+	
+	memset(&job, 0, sizeof(job));
+	device_idx = 0;
+	all_devices = 0;
+	jobs = PCAN_FLEET_JOBS;
+	jobs_given = 0;
+	ping_count = 0;
+	hub_resets = PCAN_FLEET_HUB_RESETS;
+	job.lock_mode = PCAN_LOCK_WAIT;
+	deadline_ms = 0;
+	watch_ms = 0;
+	idle_exit_ms = 0;
+	metrics_path = 0;
+	shm_name = 0;
+	socket_path = PCAN_SOCKET_PATH;
+	no_daemon = 0;
+	hotplug = PCAN_HOTPLUG_LIBUSB;
+	record_path = 0;
+	replay_path = 0;
+	replay_speed = 1;
+	snapshot_path = 0;
+	snapshot_text = 0;
+	restore_path = 0;
+	check_ids = 0;
+	memset(&snap, 0, sizeof(snap));
+	while ((opt = getopt_long(argc, argv, "hai:s:d:lq", long_options, 0)) != -1) {
+		switch (opt) {
+			case 'h':
+				help(stdout);
+				return 0;
+			case 'a':
+				all_devices = 1;
+				break;
+			case 'd':
+				if (parse_long(optarg, &device_idx))
+					exit(1);
+				
+				break;
+			case 's':
+				if (parse_long(optarg, &job.serial_nr))
+					exit(1);
+				
+				if (pcan_job_add(&job, 's'))
+					exit(1);
+				break;
+			case 'i':
+				if (parse_id_list(optarg, job.device_ids, &job.device_id_mask))
+					exit(1);
+				
+				if (pcan_job_add(&job, 'i'))
+					exit(1);
+				break;
+			case 'l':
+				job.action = 'l';
+				break;
+			case 'q':
+				if (pcan_job_add(&job, 'q'))
+					exit(1);
+				break;
+			case OPT_LOCK:
+				if (!strcmp(optarg, "wait")) {
+					job.lock_mode = PCAN_LOCK_WAIT;
+				} else if (!strcmp(optarg, "try")) {
+					job.lock_mode = PCAN_LOCK_TRY;
+				} else if (!strcmp(optarg, "none")) {
+					job.lock_mode = PCAN_LOCK_NONE;
+				} else {
+					if (parse_long(optarg, &job.lock_timeout_ms))
+						exit(1);
+					job.lock_mode = PCAN_LOCK_TIMEOUT;
+				}
+				break;
+			case OPT_DEADLINE:
+				if (parse_long(optarg, &deadline_ms))
+					exit(1);
+				break;
+			case OPT_JOBS:
+				if (parse_long(optarg, &jobs))
+					exit(1);
+				jobs_given = 1;
+				break;
+			case OPT_HUB_RESETS:
+				if (parse_long(optarg, &hub_resets))
+					exit(1);
+				break;
+			case OPT_WATCH:
+				if (parse_long(optarg, &watch_ms))
+					exit(1);
+				if (watch_ms == 0) {
+					fprintf(stderr, "invalid watch interval: 0\n");
+					exit(1);
+				}
+				job.action = 'w';
+				break;
+			case OPT_METRICS:
+				metrics_path = optarg;
+				break;
+			case OPT_RECORD:
+				record_path = optarg;
+				break;
+			case OPT_REPLAY:
+				replay_path = optarg;
+				break;
+			case OPT_REPLAY_SPEED: {
+				char *end;
+				
+				replay_speed = strtod(optarg, &end);
+				if (end == optarg || *end || replay_speed < 0) {
+					fprintf(stderr, "invalid replay speed: %s\n", optarg);
+					exit(1);
+				}
+				break;
+			}
+			case OPT_SNAPSHOT:
+			case OPT_SNAPSHOT_TEXT:
+				snapshot_path = optarg;
+				snapshot_text = (opt == OPT_SNAPSHOT_TEXT);
+				all_devices = 1;
+				if (pcan_job_add(&job, 'q'))
+					exit(1);
+				break;
+			case OPT_RESTORE:
+				restore_path = optarg;
+				job.action = 'r';
+				break;
+			case OPT_CHECK_IDS:
+			case OPT_ASSIGN_IDS:
+				check_ids = (opt == OPT_ASSIGN_IDS) ? 2 : 1;
+				all_devices = 1;
+				if (pcan_job_add(&job, 'q'))
+					exit(1);
+				break;
+			case OPT_ATOMIC:
+				job.atomic = 1;
+				break;
+			case OPT_DRY_RUN:
+				job.dry_run = 1;
+				break;
+			case OPT_BATCH:
+				job.action = 'b';
+				break;
+			case OPT_PING:
+				if (parse_long(optarg, &ping_count))
+					exit(1);
+				job.action = 'p';
+				break;
+			case OPT_POWER_CYCLE:
+				pcan_power_cycle_enabled = 1;
+				break;
+			case OPT_SHM:
+				shm_name = optarg;
+				break;
+			case OPT_SERVE:
+				job.action = 'S';
+				break;
+			case OPT_SOCKET:
+				socket_path = optarg;
+				break;
+			case OPT_NO_DAEMON:
+				no_daemon = 1;
+				break;
+			case OPT_IDLE_EXIT:
+				if (parse_long(optarg, &idle_exit_ms))
+					exit(1);
+				break;
+			case OPT_HOTPLUG:
+				if (!strcmp(optarg, "libusb")) {
+					hotplug = PCAN_HOTPLUG_LIBUSB;
+				} else if (!strcmp(optarg, "netlink")) {
+					hotplug = PCAN_HOTPLUG_NETLINK;
+				} else if (!strcmp(optarg, "inotify")) {
+					hotplug = PCAN_HOTPLUG_INOTIFY;
+				} else {
+					fprintf(stderr, "invalid hotplug backend: %s\n", optarg);
+					exit(1);
+				}
+				break;
+			default:
+				fprintf(stderr, "unknown option: %c\n", opt);
+				help(stderr);
+				return 1;
+		}
+	}
+	
+	if (job.action == 0) {
+		fprintf(stderr, "Please specify either -l, -s or -i.\n\n");
+		help(stderr);
+		return 1;
+	}
+	
+	if (all_devices && (job.action != 'q' || pcan_job_has(&job, 'i') || pcan_job_has(&job, 's'))) {
+		fprintf(stderr, "-a can only be combined with -q\n");
+		return 1;
+	}
+	
+	if (shm_name && job.action != 'w') {
+		fprintf(stderr, "--shm can only be combined with --watch\n");
+		return 1;
+	}
+	
+	if (hotplug != PCAN_HOTPLUG_LIBUSB && job.action != 'w' && job.action != 'S') {
+		fprintf(stderr, "--hotplug can only be combined with --watch or --serve\n");
+		return 1;
+	}
+	
+	if (job.action == 'p') {
+		/* all adapters at once unless limited */
+		if (!jobs_given)
+			jobs = INT_MAX;
+		all_devices = 1;
+	}
+	
+	if (restore_path) {
+		if (pcan_snapshot_load(restore_path, &snap))
+			return 1;
+		snap.job = &job;
+		all_devices = 1;
+	}
+	
+	pcan_setup_signals();
+	if (deadline_ms)
+		pcan_set_deadline(deadline_ms);
+	
+	/* a running server answers from adapters it already holds */
+	if (!no_daemon && strchr("lqis", job.action) && !all_devices && !job.dry_run &&
+		!replay_path && !record_path && !metrics_path && !pcan_power_cycle_enabled)
+	{
+		r = pcan_forward_run(socket_path, &job, device_idx);
+		if (r >= 0)
+			return r;
+	}
+	
+	ctx = 0;
+	usb_ctx = 0;
+	if (replay_path && pcan_replay_load(replay_path, replay_speed)) {
+		r = 1;
+		goto out;
+	}
+	
+	if (record_path && pcan_trace_open(record_path)) {
+		r = 1;
+		goto out;
+	}
+	
+	/* initializes libusb itself once a client connects */
+	if (job.action == 'S') {
+		r = pcan_serve_run(&job, socket_path, idle_exit_ms, hotplug);
 		
-		if (r != LIBUSB_SUCCESS)
-			printf("error %s\n", libusb_error_name(r));
+		pcan_cancel_signal = 0;
+		goto out;
+	}
+	
+	r = libusb_init(&usb_ctx);
+	if (r != 0) {
+		fprintf(stderr, "error initializing libusb\n");
+		usb_ctx = 0;
+		r = 1;
+		goto out;
+	}
+
+	libusb_set_debug(usb_ctx, 3);
+
+	if (job.action == 'w') {
+		r = pcan_watch_run(usb_ctx, watch_ms, metrics_path, shm_name, hotplug);
 		
-		memcpy(&serial_nr, &pkt[2], sizeof(serial_nr));
+		/* a signal or the deadline is the regular way to end watching */
+		pcan_cancel_signal = 0;
+		goto out;
+	}
+	
+	if (job.action == 'b') {
+		r = pcan_batch_run(usb_ctx, &job);
+		goto out;
+	}
+	
+	if (all_devices) {
+		n = pcan_fleet_enumerate(usb_ctx, &devs);
+		if (n <= 0) {
+			if (n == 0) {
+				fprintf(stderr, "error, no devices found\n");
+				free(devs);
+			}
+			r = 1;
+			goto out;
+		}
 		
-		serial_nr = le32toh(serial_nr);
-		printf("%20s: 0x%x\n", "serial_number", serial_nr);
+		if (restore_path) {
+			r = pcan_restore_run(&snap, devs, n, jobs, hub_resets) != 0;
+		} else if (job.action == 'p') {
+			struct pcan_ping ping = { .job = &job, .count = ping_count };
+			
+			r = pcan_fleet_run(devs, n, jobs, hub_resets, pcan_ping_job, &ping) != 0;
+		} else {
+			r = pcan_fleet_run(devs, n, jobs, hub_resets, pcan_fleet_job, &job) != 0;
+		}
+		if (check_ids && !pcan_cancel_signal && pcan_check_ids(devs, n, check_ids == 2, &job, jobs, hub_resets))
+			r = 1;
+		if (snapshot_path && pcan_snapshot_write(snapshot_path, devs, n, snapshot_text))
+			r = 1;
+		if (metrics_path && pcan_metrics_write(metrics_path, devs, n))
+			r = 1;
+		pcan_fleet_free(devs, n);
+		goto out;
+	}
+	
+	ctx = calloc(1, sizeof(struct pcan_ctx));
+	if (!ctx) {
+		fprintf(stderr, "error, out of memory\n");
+		r = 1;
+		goto out;
+	}
+	ctx->usb_ctx = usb_ctx;
+	ctx->lock_fd = -1;
+	ctx->out = stdout;
+	
+	r = browse_devices(ctx, device_idx, &ctx->device, &ctx->dev_handle, &ctx->pcan_type, (job.action == 'l'));
+	if (r != 0)
+		goto out;
+	
+	r = 1;
+	if (!ctx->dev_handle && !ctx->replay) {
+		fprintf(stderr, "error, requested device not found\n");
+		goto out;
 	}
 	
-	libusb_free_config_descriptor(ctx->config_descr);
+	if (job.action == 'l') {
+		r = 0;
+		goto out;
+	}
 	
-	libusb_attach_kernel_driver(ctx->dev_handle, 1);
+	if (pcan_open_device(ctx))
+		goto out;
 	
-	libusb_release_interface(ctx->dev_handle, 0);
-	if (ctx->dev_handle)
-		libusb_close(ctx->dev_handle);
+	r = pcan_run_job(ctx, &job);
+	if (r && pcan_recover_device(ctx) == 0 && pcan_open_device(ctx) == 0)
+		r = pcan_run_job(ctx, &job);
+	
+	if (metrics_path && pcan_metrics_write(metrics_path, &ctx, 1))
+		r = 1;
+	
+out:
+	if (job.dry_run && (pcan_job_has(&job, 'i') || pcan_job_has(&job, 's') || restore_path || check_ids == 2))
+		pcan_plan_summary(jobs);
+	
+	if (ctx) {
+		pcan_release_device(ctx);
+		free(ctx);
+	}
+	
+	if (pcan_cancel_signal == SIGALRM) {
+		fprintf(stderr, "error, deadline of %u ms expired\n", deadline_ms);
+		r = 1;
+	} else if (pcan_cancel_signal) {
+		fprintf(stderr, "cancelled by signal %d\n", pcan_cancel_signal);
+		r = 128 + pcan_cancel_signal;
+	}
+	
+	pcan_trace_close();
+	free(snap.recs);
+	if (usb_ctx)
+		libusb_exit(usb_ctx);
 	
-	libusb_exit(ctx->usb_ctx);
+	return r;
 }
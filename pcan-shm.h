@@ -0,0 +1,237 @@
+/*
+ * pcan-shm.h
+ * ----------
+ *
+ * Adapter inventory published by "pcan-id --watch <ms> --shm <name>" in a
+ * POSIX shared memory segment, and a reader for it. Lookups only read the
+ * mapped segment and make no system call, so they are cheap enough for the
+ * reconnect path of a CAN service.
+ *
+ * The segment is guarded by a sequence lock: pcan-id makes seq odd, updates
+ * the inventory and makes seq even again. A reader copies what it needs and
+ * retries if seq was odd or changed meanwhile. generation increases with every
+ * change of the inventory, so a reader can tell if a copy it keeps is stale.
+ * At most PCAN_SHM_MAX_ADAPTERS adapters are published, total counts all of
+ * them, so a reader can tell a missing adapter from one that did not fit.
+ *
+ * Copyright (C) 2016 Mario Kicherer (dev@kicherer.org)
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef PCAN_SHM_H
+#define PCAN_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define PCAN_SHM_MAGIC 0x4e414350 /* "PCAN" */
+#define PCAN_SHM_VERSION 2
+
+#define PCAN_SHM_MAX_ADAPTERS 64
+#define PCAN_SHM_MAX_CHANNELS 2
+#define PCAN_SHM_PATH_LEN 32
+#define PCAN_SHM_TYPE_LEN 24
+#define PCAN_SHM_NETDEV_LEN 16
+
+/* a reader gives up if the writer keeps seq odd for this many attempts */
+#define PCAN_SHM_READ_TRIES 100000
+
+/* pcan_shm_adapter.valid */
+#define PCAN_SHM_DEVICE_IDS (1 << 0)
+#define PCAN_SHM_SERIAL (1 << 1)
+
+enum pcan_shm_state {
+	/* device ids (and the serial number if valid says so) were read */
+	PCAN_SHM_IDENTIFIED = 1,
+	/* present, but the last attempt to read its identity failed */
+	PCAN_SHM_UNIDENTIFIED,
+};
+
+struct pcan_shm_adapter {
+	char port_path[PCAN_SHM_PATH_LEN];
+	char type[PCAN_SHM_TYPE_LEN];
+	/* CAN interface of each channel, empty while peak_usb is not bound */
+	char netdev[PCAN_SHM_MAX_CHANNELS][PCAN_SHM_NETDEV_LEN];
+	uint32_t device_ids[PCAN_SHM_MAX_CHANNELS];
+	uint32_t serial_nr;
+	uint8_t n_channels;
+	uint8_t valid;
+	uint8_t state;
+	uint8_t reserved;
+};
+
+struct pcan_shm {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	uint32_t n;
+	uint64_t generation;
+	/* adapters present, n is less if they did not all fit */
+	uint32_t total;
+	uint32_t reserved;
+	struct pcan_shm_adapter adapters[PCAN_SHM_MAX_ADAPTERS];
+};
+
+enum pcan_shm_key {
+	PCAN_SHM_KEY_PATH,
+	PCAN_SHM_KEY_NETDEV,
+	PCAN_SHM_KEY_SERIAL,
+	PCAN_SHM_KEY_DEVICE_ID,
+};
+
+/* map segment name read-only, returns 0 if it is missing or incompatible */
+static inline const struct pcan_shm *pcan_shm_open(const char *name)
+{
+	const struct pcan_shm *shm;
+	int fd;
+	
+	fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0)
+		return 0;
+	shm = mmap(0, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED)
+		return 0;
+	
+	if (shm->magic != PCAN_SHM_MAGIC || shm->version != PCAN_SHM_VERSION) {
+		munmap((void *) shm, sizeof(*shm));
+		return 0;
+	}
+	
+	return shm;
+}
+
+static inline void pcan_shm_close(const struct pcan_shm *shm)
+{
+	munmap((void *) shm, sizeof(*shm));
+}
+
+/* returns an even seq to pass to pcan_shm_read_retry(), or 1 on a stuck writer */
+static inline uint32_t pcan_shm_read_begin(const struct pcan_shm *shm)
+{
+	uint32_t seq;
+	int i;
+	
+	for (i = 0; i < PCAN_SHM_READ_TRIES; i++) {
+		seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		if (!(seq & 1))
+			return seq;
+	}
+	
+	return 1;
+}
+
+/* nonzero if what was read since pcan_shm_read_begin() may be torn */
+static inline int pcan_shm_read_retry(const struct pcan_shm *shm, uint32_t seq)
+{
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	
+	return __atomic_load_n(&shm->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/* current generation, without a consistent copy of the inventory */
+static inline uint64_t pcan_shm_generation(const struct pcan_shm *shm)
+{
+	return __atomic_load_n(&shm->generation, __ATOMIC_ACQUIRE);
+}
+
+/* adapters present, more than a copy holds if the segment is truncated */
+static inline uint32_t pcan_shm_total(const struct pcan_shm *shm)
+{
+	return __atomic_load_n(&shm->total, __ATOMIC_RELAXED);
+}
+
+static inline int pcan_shm_match(const struct pcan_shm_adapter *a, enum pcan_shm_key key, const char *name, uint32_t value)
+{
+	int ch;
+	
+	switch (key) {
+		case PCAN_SHM_KEY_PATH:
+			return !strncmp(a->port_path, name, sizeof(a->port_path));
+		case PCAN_SHM_KEY_NETDEV:
+			for (ch = 0; ch < a->n_channels && ch < PCAN_SHM_MAX_CHANNELS; ch++) {
+				if (!strncmp(a->netdev[ch], name, sizeof(a->netdev[ch])))
+					return 1;
+			}
+			return 0;
+		case PCAN_SHM_KEY_SERIAL:
+			return (a->valid & PCAN_SHM_SERIAL) && a->serial_nr == value;
+		case PCAN_SHM_KEY_DEVICE_ID:
+			if (!(a->valid & PCAN_SHM_DEVICE_IDS))
+				return 0;
+			for (ch = 0; ch < a->n_channels && ch < PCAN_SHM_MAX_CHANNELS; ch++) {
+				if (a->device_ids[ch] == value)
+					return 1;
+			}
+			return 0;
+	}
+	
+	return 0;
+}
+
+/*
+ * Copy the first adapter matching key to *out. name is used for the path and
+ * netdev keys, value for the others. generation may be 0. Returns 0 if found,
+ * -1 if not or if the writer is stuck, and -2 if not but adapters were left
+ * out of the segment, the one searched for may be among them.
+ */
+static inline int pcan_shm_find(const struct pcan_shm *shm, enum pcan_shm_key key, const char *name, uint32_t value,
+						  struct pcan_shm_adapter *out, uint64_t *generation)
+{
+	uint32_t seq, i, n, total;
+	int found;
+	
+	do {
+		seq = pcan_shm_read_begin(shm);
+		if (seq & 1)
+			return -1;
+		
+		found = 0;
+		n = __atomic_load_n(&shm->n, __ATOMIC_RELAXED);
+		total = __atomic_load_n(&shm->total, __ATOMIC_RELAXED);
+		for (i = 0; i < n && i < PCAN_SHM_MAX_ADAPTERS; i++) {
+			memcpy(out, &shm->adapters[i], sizeof(*out));
+			if (pcan_shm_match(out, key, name, value)) {
+				found = 1;
+				break;
+			}
+		}
+		if (generation)
+			*generation = __atomic_load_n(&shm->generation, __ATOMIC_RELAXED);
+	} while (pcan_shm_read_retry(shm, seq));
+	
+	if (found)
+		return 0;
+	
+	return total > n ? -2 : -1;
+}
+
+/* copy the whole inventory, adapters must hold PCAN_SHM_MAX_ADAPTERS entries */
+static inline int pcan_shm_copy(const struct pcan_shm *shm, struct pcan_shm_adapter *adapters, uint32_t *n, uint64_t *generation)
+{
+	uint32_t seq;
+	
+	do {
+		seq = pcan_shm_read_begin(shm);
+		if (seq & 1)
+			return -1;
+		
+		*n = __atomic_load_n(&shm->n, __ATOMIC_RELAXED);
+		if (*n > PCAN_SHM_MAX_ADAPTERS)
+			*n = PCAN_SHM_MAX_ADAPTERS;
+		memcpy(adapters, shm->adapters, *n * sizeof(*adapters));
+		if (generation)
+			*generation = __atomic_load_n(&shm->generation, __ATOMIC_RELAXED);
+	} while (pcan_shm_read_retry(shm, seq));
+	
+	return 0;
+}
+
+#endif